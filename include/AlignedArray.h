@@ -0,0 +1,48 @@
+#ifndef ALIGNED_ARRAY_H
+#define ALIGNED_ARRAY_H
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Zero-initialised array of trivial values whose storage starts on a host
+// cache line. Used for the per-set metadata arrays of Cache.
+template <typename T> class AlignedArray {
+public:
+  static const size_t LINE_SIZE = 64;
+
+  AlignedArray() : ptr(nullptr), count(0) {}
+  ~AlignedArray() { free(ptr); }
+
+  void resize(size_t n) {
+    free(this->ptr);
+    this->ptr = nullptr;
+    this->count = n;
+    if (n == 0) return;
+    // Round up so the array also ends on a line boundary
+    size_t bytes = (n * sizeof(T) + LINE_SIZE - 1) / LINE_SIZE * LINE_SIZE;
+    void *p = nullptr;
+    if (posix_memalign(&p, LINE_SIZE, bytes) != 0) {
+      fprintf(stderr, "Unable to allocate %zu bytes\n", bytes);
+      exit(-1);
+    }
+    memset(p, 0, bytes);
+    this->ptr = static_cast<T *>(p);
+  }
+
+  T &operator[](size_t i) { return this->ptr[i]; }
+  const T &operator[](size_t i) const { return this->ptr[i]; }
+  T *data() { return this->ptr; }
+  const T *data() const { return this->ptr; }
+  size_t size() const { return this->count; }
+
+private:
+  AlignedArray(const AlignedArray &) = delete;
+  AlignedArray &operator=(const AlignedArray &) = delete;
+
+  T *ptr;
+  size_t count;
+};
+
+#endif
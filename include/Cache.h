@@ -3,8 +3,46 @@
 
 #include <cstdint>
 #include <vector>
+#include "AlignedArray.h"
+#include "Dram.h"
 #include "MemoryManager.h"
-#include <queue>
+#include "Prefetcher.h"
+#include "Replacement.h"
+#include "TagMatch.h"
+
+// Techniques selected by the tech argument of Cache
+#define PREFETCHING 1
+#define FIFO 2
+#define VICTIM 3
+
+// How a level relates to the levels above it. Inclusive and exclusive
+// levels need the block size of the levels above.
+enum InclusionPolicy {
+    INCLUSION_NINE = 0,   // non-inclusive non-exclusive, blocks are copied up
+    INCLUSION_INCLUSIVE,  // evictions back-invalidate the levels above
+    INCLUSION_EXCLUSIVE,  // blocks move up on a hit, victims of the level
+                          // above move down, misses are not allocated
+};
+
+const char *inclusionName(InclusionPolicy policy);
+bool parseInclusion(const char *name, InclusionPolicy *policy);
+
+// What a store hitting a level does with the level below
+enum WritePolicy {
+    WRITE_BACK = 0,   // only the line is updated, written back on eviction
+    WRITE_THROUGH,    // the store is also sent to the level below
+};
+
+// What a store missing a level does
+enum WriteMissPolicy {
+    WRITE_ALLOCATE = 0,  // the block is fetched and the store hits it
+    WRITE_NO_ALLOCATE,   // the store goes around the level to the one below
+};
+
+const char *writePolicyName(WritePolicy policy);
+bool parseWritePolicy(const char *name, WritePolicy *policy);
+const char *writeMissPolicyName(WriteMissPolicy policy);
+bool parseWriteMissPolicy(const char *name, WriteMissPolicy *policy);
 
 class MemoryManager;
 
@@ -33,22 +71,48 @@ public:
         uint32_t associativity;
         uint32_t hitLatency;
         uint32_t missLatency;
+        // Timing/statistics only: blocks keep no data, reads return 0
+        bool tagOnly;
+        ReplacementKind replacement;
+        const TraceOracle *oracle;  // trace lookahead, only for REPLACE_OPT
+        // Fully associative buffer of lines evicted from this level, probed
+        // on every miss. 0 entries disables it.
+        uint32_t victimEntries;
+        uint32_t victimLatency;     // cycles to serve a miss from the buffer
+        // Prefetcher, PREFETCHING selects the stride one if none is set.
+        // The sizes are 0 for the defaults of the kind; stream buffers
+        // take their count from the table size and depth from the degree.
+        PrefetcherKind prefetcher;
+        uint32_t prefetchTableSize;
+        uint32_t prefetchDegree;    // blocks requested per trigger
+        uint32_t prefetchDistance;  // strides between access and first request
+        // Miss status holding registers. 0 keeps the serial timing model in
+        // which every access waits for the one before it; otherwise misses
+        // to the lower level overlap, at most this many at a time.
+        uint32_t mshrEntries;
+        // Main memory timing below a level without a lower cache, nullptr
+        // for a flat MEMORY_LATENCY
+        Dram *dram;
+        InclusionPolicy inclusion;  // towards the levels above
+        WritePolicy writePolicy;
+        WriteMissPolicy writeMiss;
+        // Write-combining buffer for the stores this level sends down,
+        // 0 entries makes every such store wait for the level below
+        uint32_t writeBufferEntries;
+
+        // Address decomposition, derived by Cache from the fields above
+        uint32_t offsetBits;
+        uint32_t indexBits;
+        uint32_t tagShift;     // offsetBits + indexBits
+        uint32_t offsetMask;
+        uint32_t indexMask;
     };
 
-    struct Block {
-        bool valid;
-        bool modified;
-        uint32_t tag;
-        uint32_t id;
-        uint32_t size;
-        uint32_t lastReference;
-        std::vector<uint8_t> data;
-        Block() {}
-        Block(const Block &b)
-        : valid(b.valid), modified(b.modified), tag(b.tag), id(b.id),
-            size(b.size) {
-        data = b.data;
-        }
+    // Per-line state bits kept in Cache::states
+    enum LineState : uint8_t {
+        LINE_VALID = 1,
+        LINE_MODIFIED = 2,
+        LINE_PREFETCHED = 4,  // filled by a prefetch, not demanded yet
     };
 
     struct Statistics {
@@ -57,14 +121,71 @@ public:
         uint32_t numHit;
         uint32_t numMiss;
         uint64_t totalCycles;
+        // Victim buffer probes, a hit still counts as a miss above
+        uint32_t numVictimHit;
+        uint32_t numVictimMiss;
+        uint64_t victimCycles;
+        // Prefetches filled, demanded before eviction, demanded while still
+        // in flight, and demand misses caused by their evictions
+        uint32_t numPrefetch;
+        uint32_t numPrefetchUseful;
+        uint32_t numPrefetchLate;
+        uint32_t numPrefetchPolluting;
+        // Cycles demand accesses waited on late prefetches. The levels that
+        // serviced the prefetch already count them, so totalCycles of this
+        // level charges a late prefetch at most missLatency.
+        uint64_t prefetchLateCycles;
+        // Cycle at which the last counted request completed, then hits on a
+        // block whose miss is still outstanding and misses that had to wait
+        // for a free MSHR
+        uint64_t elapsedCycles;
+        uint32_t numMshrMerged;
+        uint32_t numMshrStalls;
+        // Evictions of an inclusive level that dropped copies above
+        uint32_t numBackInvalidation;
+        // Stores sent to the level below, those merged into a block already
+        // buffered, those that waited for a free buffer entry, and buffered
+        // blocks written out. Occupancy adds up the entries in use after
+        // every buffered store.
+        uint32_t numWriteThrough;
+        uint32_t numWriteCombined;
+        uint32_t numWriteBufferStalls;
+        uint32_t numWriteBufferDrains;
+        uint64_t writeBufferOccupancy;
+        uint32_t writeBufferPeak;
     };
 
+    // Victim buffer size used by the VICTIM technique when the policy sets none
+    static const uint32_t DEFAULT_VICTIM_ENTRIES = 8;
+    // MSHRs per level when the MLP timing model is asked for without a count
+    static const uint32_t DEFAULT_MSHR_ENTRIES = 8;
+    // Write buffer size when one is asked for without a count
+    static const uint32_t DEFAULT_WRITE_BUFFER_ENTRIES = 8;
+
     Cache(MemoryManager *manager, Policy policy, Cache *lowerCache = nullptr, int tech=0);
+    virtual ~Cache();
 
     bool inCache(uint32_t addr);
-    uint32_t getBlockId(uint32_t addr);
-    uint8_t getByte(uint32_t addr, uint32_t *cycles = nullptr, bool countStats = true);
-    virtual void setByte(uint32_t addr, uint8_t val, uint32_t *cycles = nullptr, bool countStats = true);
+    uint32_t getBlockId(uint32_t addr) { return (this->*lookupFunc)(addr); }
+    // pc is the address of the instruction making the access, 0 if unknown
+    uint8_t getByte(uint32_t addr, uint32_t *cycles = nullptr, bool countStats = true,
+                    uint32_t pc = 0);
+    virtual void setByte(uint32_t addr, uint8_t val, uint32_t *cycles = nullptr,
+                         bool countStats = true, uint32_t pc = 0);
+
+    // Whole-block transfers between levels, one lookup per block touched.
+    // data may be nullptr when the caller keeps no block data.
+    // Writes are only counted for stores sent down by write-through or
+    // no-write-allocate levels, write-backs are not.
+    void readBlock(uint32_t addr, uint32_t size, uint8_t *data,
+                   uint32_t *cycles = nullptr, bool countStats = true);
+    void writeBlock(uint32_t addr, uint32_t size, const uint8_t *data,
+                    uint32_t *cycles = nullptr, bool countStats = false);
+    // Exclusive levels only. takeBlock serves a miss of the level above,
+    // the block leaves this level; insertBlock receives a victim of the
+    // level above. Both carry whether the block is modified.
+    bool takeBlock(uint32_t addr, uint8_t *data, uint32_t *cycles);
+    void insertBlock(uint32_t addr, const uint8_t *data, bool dirty);
 
     void printInfo(bool verbose);
     void printStatistics();
@@ -74,32 +195,163 @@ public:
     void write(uint32_t addr, uint8_t val) override;
 
 private:
-    uint32_t referenceCounter;
+    uint64_t referenceCounter;
     MemoryManager *memory;
     Cache *lowerCache;
+    std::vector<Cache *> upperCaches;
     Policy policy;
-    std::vector<Block> blocks;
-    int tech;
-    uint32_t previous_stride, previous_address, stride=0;
-    bool is_prefetch = false;
-    int tripleSame, tripleDiff;
+    // Structure-of-arrays set metadata. Line i of set s lives at index
+    // (s << setStrideBits) + i in every array; the stride is the
+    // associativity rounded up to a power of two so that a set never
+    // straddles a host cache line unless it is wider than one.
+    uint32_t setStrideBits;
+    AlignedArray<uint32_t> tags;
+    AlignedArray<uint8_t> states;
+    std::vector<uint32_t> validCount; // per set
+    ReplacementPolicy *replacement;
+    std::vector<uint8_t> blockData; // blockSize bytes per line, unless tagOnly
+    std::vector<uint8_t> fillBuffer;
+    bool fillDirty;                 // block in fillBuffer came up modified
+    static const uint32_t NO_LINE = 0xFFFFFFFF;  // access() passed the block through
+    TagMatchFunc tagMatch;          // chosen for this associativity and host
+    // Victim buffer, entry i holds the block starting at victimAddrs[i]
+    std::vector<uint32_t> victimAddrs;
+    std::vector<uint8_t> victimStates;
+    std::vector<uint8_t> victimData;  // blockSize bytes per entry, unless tagOnly
+    LruReplacement victimOrder;
+    uint64_t victimClock;
 
-    std::queue<uint32_t> FIFO_id;
+    // Set lookup and victim selection, bound by bindEngine() to versions
+    // compiled for this geometry when one exists (see CacheEngine.cpp)
+    typedef uint32_t (Cache::*LookupFunc)(uint32_t addr);
+    typedef uint32_t (Cache::*VictimFunc)(uint32_t id);
+    LookupFunc lookupFunc;
+    VictimFunc victimFunc;
+    bool fixedEngine;
+    int tech;
+    Prefetcher *prefetcher;
+    StreamBuffers *streams;
+    std::vector<uint32_t> prefetchCandidates;  // trained, not issued yet
+    int32_t pendingRefill;                     // stream buffer, or -1
+    // Block between being fetched and having its tag stored, or NO_LINE.
+    // An inclusive level below evicting it meanwhile would miss the copy
+    // being filled here, so the back-invalidation marks the fill lost and
+    // takes its data if modified; the block then passes through.
+    uint32_t fillBlock;
+    uint8_t fillState;
+    const uint8_t *fillData;
+    bool fillLost;
+    bool inclusiveBelow;  // some level below back-invalidates this one
+    // One bit per hashed block address, set when a prefetch evicts the
+    // block so that a later demand miss on it can be blamed on the prefetch
+    std::vector<uint64_t> pollutionFilter;
+    static const uint32_t POLLUTION_FILTER_BITS = 4096;
+    // Cycle at this level. L1 advances it by the latency of each access, a
+    // lower level is set to the arrival time of every request sent to it.
+    uint64_t clock;
+    // Prefetches whose block is still on its way from the lower level, they
+    // are filled once the clock reaches their ready time
+    struct InFlight {
+        uint32_t blockAddr;
+        uint64_t ready;
+        bool valid;
+    };
+    std::vector<InFlight> inFlight;
+    std::vector<uint8_t> inFlightData;  // blockSize bytes per entry, unless tagOnly
+    static const uint32_t PREFETCH_QUEUE_SIZE = 16;
+    static const uint32_t MEMORY_LATENCY = 100;
+    uint64_t completion;  // when the last counted request served here completes
+    // Outstanding misses, an entry is free once the clock reaches its ready time
+    struct Mshr {
+        uint32_t blockAddr;
+        uint64_t ready;
+    };
+    std::vector<Mshr> mshrs;
+    // Write-combining buffer, entry i holds the bytes of its block marked in
+    // writeBufferMask. Entries leave oldest first, one at a time, whenever
+    // the path to the level below is free.
+    struct WriteEntry {
+        uint32_t blockAddr;
+        uint64_t arrival;  // cycle of the first store merged into it
+        bool counted;      // holds a counted store
+        bool valid;
+    };
+    std::vector<WriteEntry> writeBuffer;
+    std::vector<uint8_t> writeBufferMask;  // blockSize bytes per entry
+    std::vector<uint8_t> writeBufferData;  // blockSize bytes per entry, unless tagOnly
+    uint64_t writeBufferFree;  // cycle the path to the level below is free
 
-    void handlePrefetching(uint32_t addr);
+    void handlePrefetching(uint32_t addr, uint32_t pc, bool miss);
+    void issuePrefetches();
+    bool upperFilling() const;
     void prefetch(uint32_t addr);
+    void refillStream(uint32_t buffer);
+    int32_t findInFlight(uint32_t blockAddr);
+    void retirePrefetches();
+    uint32_t completePrefetch(uint32_t entry);
+    uint32_t allocateMshr();
+    void storeToLowerLevel(uint32_t addr, uint32_t size, const uint8_t *data,
+                           uint32_t *cycles, bool countStats);
+    void bufferStore(uint32_t addr, uint32_t size, const uint8_t *data,
+                     bool countStats);
+    void retireWriteBuffer();
+    int32_t oldestWriteEntry();
+    void drainWriteEntry(uint32_t entry, uint64_t start);
+    void flushWriteEntry(uint32_t blockAddr);
+    bool mergeWriteEntry(uint32_t blockAddr, uint8_t *data);
+    uint64_t writeToLowerLevel(uint32_t addr, uint32_t size, const uint8_t *data,
+                               const uint8_t *mask, bool countStats, uint64_t now);
+    int32_t findMshr(uint32_t blockAddr);
+    uint32_t pollutionBit(uint32_t blockAddr) const;
+    void markPolluted(uint32_t blockAddr);
+    bool takePolluted(uint32_t blockAddr);
     void initCache();
-    void loadBlockFromLowerLevel(uint32_t addr, uint32_t *cycles);
-    uint32_t getReplacementBlockId(uint32_t begin, uint32_t end);
-    void writeBlockToLowerLevel(Block &b);
+    uint32_t access(uint32_t addr, bool isWrite, uint32_t *cycles, bool countStats,
+                    uint32_t pc, bool allocate = true);
+    uint32_t loadBlockFromLowerLevel(uint32_t addr, uint32_t *cycles,
+                                     bool allocate = true);
+    uint64_t fetchBlock(uint32_t blockAddr, uint8_t *data, uint32_t *cycles,
+                        bool *dirty = nullptr);
+    void evictBlock(uint32_t addr, uint8_t *data, uint8_t state);
+    bool invalidateBlock(uint32_t addr, uint8_t *data, bool *dirty);
+    void invalidateLine(uint32_t line);
+    uint32_t installBlock(uint32_t addr, const uint8_t *data, uint8_t state);
+    bool holdsBlock(uint32_t addr);
+    int32_t findVictimEntry(uint32_t addr);
+    uint32_t swapFromVictimBuffer(uint32_t addr, uint32_t entry);
+    void moveToVictimBuffer(uint32_t line);
+    uint32_t getReplacementBlockId(uint32_t id) {
+        return (this->*victimFunc)(id);
+    }
+    void bindEngine();
+    uint32_t lookupRuntime(uint32_t addr);
+    uint32_t victimRuntime(uint32_t id);
+    template <uint32_t BlockSize, uint32_t SetNum, uint32_t Ways>
+    uint32_t lookupFixed(uint32_t addr);
+    template <uint32_t Ways, class Repl>
+    uint32_t victimFixed(uint32_t id);
+    template <uint32_t Ways>
+    static VictimFunc selectVictimFixed(ReplacementKind kind);
+    void writeBlockToLowerLevel(uint32_t addrBegin, const uint8_t *data);
     // Utility Functions
     bool isPolicyValid();
     bool isPowerOfTwo(uint32_t n);
     uint32_t log2i(uint32_t val);
-    uint32_t getTag(uint32_t addr);
-    uint32_t getId(uint32_t addr);
-    uint32_t getOffset(uint32_t addr);
-    uint32_t getAddr(Block &b);
+    void initAddressBits();
+    // Hot path, only shifts and masks precomputed in initAddressBits()
+    uint32_t getTag(uint32_t addr) const { return addr >> policy.tagShift; }
+    uint32_t getId(uint32_t addr) const {
+        return (addr >> policy.offsetBits) & policy.indexMask;
+    }
+    uint32_t getOffset(uint32_t addr) const { return addr & policy.offsetMask; }
+    uint32_t getBlockAddr(uint32_t addr) const { return addr & ~policy.offsetMask; }
+    uint32_t getAddr(uint32_t line) const {
+        return (tags[line] << policy.tagShift) |
+               ((line >> setStrideBits) << policy.offsetBits);
+    }
+    uint8_t *getLineData(uint32_t line) {
+        return &blockData[size_t(line) * policy.blockSize];
+    }
 
 };
 
@@ -0,0 +1,87 @@
+#ifndef DRAM_H
+#define DRAM_H
+
+#include <cstdint>
+#include <vector>
+
+enum DramPagePolicy {
+  PAGE_OPEN = 0,   // rows stay open until another row of the bank is needed
+  PAGE_CLOSED,     // every access precharges its bank right after the burst
+};
+
+// How block addresses spread over channels, ranks and banks, listed from
+// the most significant field above the block offset
+enum DramMapping {
+  // Row, rank, bank, channel, column: consecutive blocks share a row
+  DRAM_MAP_ROW = 0,
+  // Row, column, rank, bank, channel: consecutive blocks go to different
+  // channels and banks
+  DRAM_MAP_LINE,
+  // As DRAM_MAP_ROW with the bank index XORed with the low row bits
+  // (Zhang et al., MICRO 2000), so rows conflicting in one bank scatter
+  DRAM_MAP_XOR,
+};
+
+// Timings are in CPU cycles
+struct DramConfig {
+  uint32_t channels;
+  uint32_t ranks;       // per channel
+  uint32_t banks;       // per rank
+  uint32_t rowSize;     // bytes per row of a bank
+  uint32_t blockSize;   // bytes per request
+  uint32_t tRCD;        // activate to column command
+  uint32_t tCAS;        // column command to data
+  uint32_t tRP;         // precharge
+  uint32_t tBurst;      // data bus time of one block
+  DramPagePolicy pagePolicy;
+  DramMapping mapping;
+};
+
+const char *dramPagePolicyName(DramPagePolicy policy);
+bool parseDramPagePolicy(const char *name, DramPagePolicy *policy);
+const char *dramMappingName(DramMapping mapping);
+bool parseDramMapping(const char *name, DramMapping *mapping);
+
+// Main memory below the last cache level. Each bank keeps its open row and
+// the cycle it is free again, each channel the cycle its data bus is free.
+// A request to the open row only pays tCAS, one to a precharged bank
+// tRCD + tCAS and one to another row tRP + tRCD + tCAS, after waiting for
+// its bank. The block is then sent over the channel bus in tBurst once the
+// bus is free. Ranks only add banks, rank to rank timing is not modelled.
+class Dram {
+public:
+  struct Statistics {
+    uint32_t numRead;
+    uint32_t numWrite;
+    uint32_t numRowHit;       // open row matched
+    uint32_t numRowEmpty;     // bank was precharged
+    uint32_t numRowConflict;  // another row had to be closed
+    uint64_t totalCycles;     // latency of every request
+  };
+
+  explicit Dram(const DramConfig &config);
+
+  // Request for the block at addr arriving at cycle now, returns its latency
+  uint32_t access(uint32_t addr, bool isWrite, uint64_t now);
+
+  void printInfo();
+  void printStatistics();
+  Statistics statistics;
+
+private:
+  struct Bank {
+    uint32_t openRow;
+    bool open;
+    uint64_t ready;
+  };
+
+  // Bank index over all channels and ranks, and row, of a block address
+  void map(uint32_t addr, uint32_t *bank, uint32_t *channel, uint32_t *row);
+
+  DramConfig config;
+  uint32_t offsetBits, columnBits, channelBits, bankBits, rankBits;
+  std::vector<Bank> banks;        // per channel, rank and bank
+  std::vector<uint64_t> busFree;  // per channel
+};
+
+#endif
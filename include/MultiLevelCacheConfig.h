@@ -13,6 +13,21 @@ public:
         policy.associativity = 1;          // direct-mapped
         policy.hitLatency = 1;
         policy.missLatency = 8;
+        policy.tagOnly = true;             // traces carry no data
+        policy.replacement = REPLACE_LRU;
+        policy.oracle = nullptr;
+        policy.victimEntries = 0;          // enabled by the VICTIM technique
+        policy.victimLatency = 2;
+        policy.prefetcher = PREFETCH_NONE;  // stride with the PREFETCHING technique
+        policy.prefetchTableSize = 0;
+        policy.prefetchDegree = 0;
+        policy.prefetchDistance = 0;
+        policy.mshrEntries = 0;            // serial timing, -m gives MSHRs
+        policy.dram = nullptr;
+        policy.inclusion = INCLUSION_NINE;
+        policy.writePolicy = WRITE_BACK;
+        policy.writeMiss = WRITE_ALLOCATE;
+        policy.writeBufferEntries = 0;
         return policy;
     }
 
@@ -24,6 +39,21 @@ public:
         policy.associativity = 8;          // 8-way
         policy.hitLatency = 8;
         policy.missLatency = 20;
+        policy.tagOnly = true;
+        policy.replacement = REPLACE_LRU;
+        policy.oracle = nullptr;
+        policy.victimEntries = 0;
+        policy.victimLatency = 9;
+        policy.prefetcher = PREFETCH_NONE;
+        policy.prefetchTableSize = 0;
+        policy.prefetchDegree = 0;
+        policy.prefetchDistance = 0;
+        policy.mshrEntries = 0;
+        policy.dram = nullptr;
+        policy.inclusion = INCLUSION_NINE;
+        policy.writePolicy = WRITE_BACK;
+        policy.writeMiss = WRITE_ALLOCATE;
+        policy.writeBufferEntries = 0;
         return policy;
     }
 
@@ -35,8 +65,41 @@ public:
         policy.associativity = 16;         // 16-way
         policy.hitLatency = 20;
         policy.missLatency = 100;
+        policy.tagOnly = true;
+        policy.replacement = REPLACE_LRU;
+        policy.oracle = nullptr;
+        policy.victimEntries = 0;
+        policy.victimLatency = 21;
+        policy.prefetcher = PREFETCH_NONE;
+        policy.prefetchTableSize = 0;
+        policy.prefetchDegree = 0;
+        policy.prefetchDistance = 0;
+        policy.mshrEntries = 0;
+        policy.dram = nullptr;             // flat memory latency unless -d
+        policy.inclusion = INCLUSION_NINE;
+        policy.writePolicy = WRITE_BACK;
+        policy.writeMiss = WRITE_ALLOCATE;
+        policy.writeBufferEntries = 0;
         return policy;
     }
+
+    // DDR4-2400 like timings for a 3 GHz core, so a request to a
+    // precharged bank costs about the flat memory latency
+    static DramConfig getDramConfig() {
+        DramConfig config;
+        config.channels = 2;
+        config.ranks = 2;
+        config.banks = 8;
+        config.rowSize = 8 * 1024;
+        config.blockSize = 64;
+        config.tRCD = 42;
+        config.tCAS = 42;
+        config.tRP = 42;
+        config.tBurst = 10;
+        config.pagePolicy = PAGE_OPEN;
+        config.mapping = DRAM_MAP_ROW;
+        return config;
+    }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,252 @@
+#ifndef PREFETCHER_H
+#define PREFETCHER_H
+
+#include <cstdint>
+#include <vector>
+
+enum PrefetcherKind {
+  PREFETCH_NONE = 0,
+  PREFETCH_STRIDE,
+  PREFETCH_NEXT_LINE,
+  PREFETCH_STREAM,
+  PREFETCH_BOP,
+  PREFETCH_SMS,
+};
+
+// Prefetch engine of one cache level, trained on the level's demand
+// accesses. Addresses it returns are filled into the cache unless already
+// present.
+class Prefetcher {
+public:
+  virtual ~Prefetcher() = default;
+
+  // Train on an access and append the addresses worth prefetching. miss is
+  // also set on the first hit to a prefetched line, the miss it avoided.
+  virtual void observe(uint32_t addr, uint32_t pc, bool miss,
+                       std::vector<uint32_t> &prefetches) = 0;
+  // The block at blockAddr left the cache
+  virtual void evicted(uint32_t blockAddr) {}
+};
+
+// tableSize, degree and distance are 0 for the defaults of the kind. Stream
+// buffers are managed by Cache itself, so PREFETCH_STREAM like
+// PREFETCH_NONE yields nullptr.
+Prefetcher *createPrefetcher(PrefetcherKind kind, uint32_t tableSize,
+                             uint32_t degree, uint32_t distance,
+                             uint32_t blockSize);
+const char *prefetcherName(PrefetcherKind kind);
+bool parsePrefetcher(const char *name, PrefetcherKind *kind);
+
+// Reference prediction table stride prefetcher (Chen and Baer, 1995).
+//
+// Entries are indexed by the PC of the access, so interleaved streams from
+// different instructions train separately. Traces without PCs (pc == 0)
+// fall back to the address region of the access, and a new region entry
+// inherits the training of a neighbouring region whose stream continues
+// into it. Each entry keeps the last address, the stride between its last
+// two accesses and a confidence state. A steady stride survives a single
+// irregular access; an entry that mispredicts twice in a row stops
+// prefetching until its stride repeats. Predicting entries request degree
+// blocks starting distance strides ahead.
+class StridePrefetcher final : public Prefetcher {
+public:
+  // 0 for any argument selects its default
+  StridePrefetcher(uint32_t tableSize, uint32_t degree, uint32_t distance,
+                   uint32_t blockSize);
+
+  void observe(uint32_t addr, uint32_t pc, bool miss,
+               std::vector<uint32_t> &prefetches) override;
+
+  static const uint32_t DEFAULT_TABLE_SIZE = 64;
+  static const uint32_t DEFAULT_DEGREE = 1;
+  static const uint32_t DEFAULT_DISTANCE = 1;
+
+private:
+  static const uint32_t REGION_BITS = 12;  // fallback index, 4 KB regions
+
+  enum State : uint8_t { INITIAL, TRANSIENT, STEADY, NO_PREDICTION };
+
+  struct Entry {
+    uint32_t key;       // PC, or region for traces without PCs
+    uint32_t lastAddr;
+    int32_t stride;
+    State state;
+    bool valid;
+  };
+
+  Entry &lookup(uint32_t key);
+
+  std::vector<Entry> table;
+  uint32_t degree, distance, blockSize;
+};
+
+// Tagged next-N-line prefetching (Smith, 1982): a miss, or the first hit
+// on a prefetched line, requests the degree blocks following it, starting
+// distance blocks ahead. Sequential streams therefore keep running ahead
+// of the demand accesses without one miss per block.
+class NextLinePrefetcher final : public Prefetcher {
+public:
+  NextLinePrefetcher(uint32_t degree, uint32_t distance, uint32_t blockSize);
+
+  void observe(uint32_t addr, uint32_t pc, bool miss,
+               std::vector<uint32_t> &prefetches) override;
+
+  static const uint32_t DEFAULT_DEGREE = 1;
+  static const uint32_t DEFAULT_DISTANCE = 1;
+
+private:
+  uint32_t degree, distance, blockSize;
+};
+
+// Best-Offset prefetching (Michaud, HPCA 2016). Every miss X, or first hit
+// on a prefetched line, requests X + D for the currently best offset D.
+// Meanwhile one candidate offset per trigger is scored: offset d earns a
+// point when X - d is in the recent requests table, i.e. prefetching with
+// d would have covered X. A learning phase ends once an offset reaches
+// SCORE_MAX or every offset has been tried ROUND_MAX times; the best one
+// becomes D, and prefetching pauses while even the best scores poorly.
+// Candidates are the block offsets up to 256 whose only prime factors are
+// 2, 3 and 5. The recent requests table records trigger blocks rather
+// than completed fills.
+class BestOffsetPrefetcher final : public Prefetcher {
+public:
+  // degree consecutive multiples of the best offset are requested
+  BestOffsetPrefetcher(uint32_t degree, uint32_t blockSize);
+
+  void observe(uint32_t addr, uint32_t pc, bool miss,
+               std::vector<uint32_t> &prefetches) override;
+
+  static const uint32_t DEFAULT_DEGREE = 1;
+
+private:
+  static const uint32_t MAX_OFFSET = 256;
+  static const uint32_t RR_ENTRIES = 256;
+  static const uint32_t SCORE_MAX = 31;
+  static const uint32_t ROUND_MAX = 100;
+  static const uint32_t BAD_SCORE = 1;
+
+  uint32_t rrIndex(uint32_t block) const {
+    return (block ^ (block >> 8)) % RR_ENTRIES;
+  }
+  void endLearning();
+
+  uint32_t degree, blockBits;
+  std::vector<uint32_t> offsets;
+  std::vector<uint32_t> scores;          // per offset
+  std::vector<uint32_t> recentRequests;  // block numbers, + 1 so 0 is empty
+  uint32_t testIndex, round;
+  uint32_t bestOffset;                   // 0 while prefetching is off
+};
+
+// Spatial memory streaming style footprint prefetcher (Somogyi et al.,
+// ISCA 2006). Memory is cut into regions of 32 blocks. The first access to
+// a region starts a generation that records which blocks of the region are
+// touched, until a block of the region leaves the cache. The footprint is
+// then stored under the PC and region offset of the triggering access, and
+// the next generation triggered the same way prefetches that footprint at
+// once. Without PCs the pattern is keyed by the trigger offset alone.
+class SmsPrefetcher final : public Prefetcher {
+public:
+  // tableSize is the number of pattern history entries
+  SmsPrefetcher(uint32_t tableSize, uint32_t blockSize);
+
+  void observe(uint32_t addr, uint32_t pc, bool miss,
+               std::vector<uint32_t> &prefetches) override;
+  void evicted(uint32_t blockAddr) override;
+
+  static const uint32_t DEFAULT_TABLE_SIZE = 1024;
+
+private:
+  static const uint32_t REGION_BLOCKS = 32;
+  static const uint32_t GENERATIONS = 64;  // regions tracked at once
+
+  struct Generation {
+    uint32_t region;
+    uint32_t key;        // PC and trigger offset
+    uint32_t footprint;  // one bit per block of the region
+    uint64_t lastUse;
+    bool valid;
+  };
+  struct Pattern {
+    uint32_t key;
+    uint32_t footprint;
+    bool valid;
+  };
+
+  Generation *findGeneration(uint32_t region);
+  void commit(Generation &generation);
+
+  uint32_t blockBits, regionBits;
+  std::vector<Generation> generations;
+  std::vector<Pattern> patterns;
+  uint64_t clock;
+};
+
+// Stream buffers (Jouppi, ISCA 1990). A miss that no buffer can serve
+// restarts the least recently used buffer on the blocks following it. The
+// buffers sit outside the cache, so wrong prefetches never evict anything:
+// a miss matching the head of a buffer moves that block into the cache and
+// the buffer fetches one more block at its tail.
+//
+// This class only keeps the buffered blocks, Cache fetches them. Cache
+// also keeps buffered blocks disjoint from its own lines, so buffered data
+// can never be stale.
+class StreamBuffers {
+public:
+  // 0 for count or depth selects the default
+  StreamBuffers(uint32_t count, uint32_t depth, uint32_t blockSize,
+                bool keepData);
+
+  // Buffer whose head holds the block at blockAddr, or -1
+  int32_t findHead(uint32_t blockAddr) const;
+  // Data of the head of buffer, nullptr when no data is kept
+  const uint8_t *getHeadData(uint32_t buffer) const;
+  // Cycle at which the block at the head of buffer arrives
+  uint64_t getHeadReady(uint32_t buffer) const {
+    return this->ready[this->slot(buffer, 0)];
+  }
+  bool contains(uint32_t blockAddr) const;
+  // Drop every buffered copy of the block, it has entered the cache
+  void invalidate(uint32_t blockAddr);
+  // Buffer served a miss, it is the last to be reallocated
+  void touch(uint32_t buffer, uint64_t stamp) { this->lastUse[buffer] = stamp; }
+
+  // Start the least recently used buffer over at block firstAddr
+  uint32_t allocate(uint32_t firstAddr, uint64_t stamp);
+  bool isFull(uint32_t buffer) const {
+    return this->size[buffer] == this->depth;
+  }
+  // Block the buffer appends next
+  uint32_t getNext(uint32_t buffer) const { return this->next[buffer]; }
+  // Append the next block, returns the slot for its data or nullptr
+  uint8_t *push(uint32_t buffer);
+  // The block appended last arrives at cycle time
+  void setTailReady(uint32_t buffer, uint64_t time) {
+    this->ready[this->slot(buffer, this->size[buffer] - 1)] = time;
+  }
+  // Move past the next block without buffering it
+  void skip(uint32_t buffer) { this->next[buffer] += this->blockSize; }
+
+  uint32_t getCount() const { return uint32_t(this->size.size()); }
+  uint32_t getDepth() const { return this->depth; }
+
+  static const uint32_t DEFAULT_COUNT = 4;
+  static const uint32_t DEFAULT_DEPTH = 4;
+
+private:
+  // Entry i of buffer b, counted from its head
+  uint32_t slot(uint32_t buffer, uint32_t i) const {
+    return buffer * this->depth + (this->head[buffer] + i) % this->depth;
+  }
+  void dropInvalidHead(uint32_t buffer);
+
+  uint32_t depth, blockSize;
+  std::vector<uint32_t> addrs;    // per slot
+  std::vector<uint8_t> valid;     // per slot
+  std::vector<uint64_t> ready;    // per slot
+  std::vector<uint8_t> data;      // blockSize bytes per slot, if kept
+  std::vector<uint32_t> head, size, next;  // per buffer
+  std::vector<uint64_t> lastUse;  // per buffer
+};
+
+#endif
@@ -0,0 +1,276 @@
+#ifndef REPLACEMENT_H
+#define REPLACEMENT_H
+
+#include <cstdint>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+enum ReplacementKind {
+  REPLACE_LRU = 0,
+  REPLACE_FIFO,
+  REPLACE_PLRU,
+  REPLACE_NRU,
+  REPLACE_RANDOM,
+  REPLACE_SRRIP,
+  REPLACE_BRRIP,
+  REPLACE_DRRIP,
+  REPLACE_OPT,
+};
+
+class TraceOracle;
+
+// Replacement state of one cache level.
+//
+// Lines are addressed like Cache metadata, (set << strideBits) + way. Cache
+// fills invalid ways itself before asking for a victim, so victim() is only
+// called on full sets. addr is the block address held by the line and stamp
+// the level's reference counter, which does not advance on uncounted
+// accesses such as write-backs from above.
+class ReplacementPolicy {
+public:
+  virtual ~ReplacementPolicy() = default;
+
+  virtual void init(uint32_t setNum, uint32_t ways, uint32_t strideBits) = 0;
+  // Hit on a valid line
+  virtual void touch(uint32_t line, uint32_t addr, uint64_t stamp) = 0;
+  // Line has just been filled
+  virtual void insert(uint32_t line, uint32_t addr, uint64_t stamp) = 0;
+  // Line was invalidated and is free again
+  virtual void invalidate(uint32_t line) = 0;
+  // Way to evict from full set id
+  virtual uint32_t victim(uint32_t id) = 0;
+
+  // Recency information for printInfo, 0 when the policy keeps none
+  virtual uint64_t getStamp(uint32_t line) const { return 0; }
+};
+
+// oracle is only used by REPLACE_OPT
+ReplacementPolicy *createReplacementPolicy(ReplacementKind kind,
+                                           const TraceOracle *oracle);
+const char *replacementName(ReplacementKind kind);
+bool parseReplacement(const char *name, ReplacementKind *kind);
+
+// True LRU with constant time update and victim selection.
+//
+// Every set keeps its ways in a doubly linked recency list with the MRU way
+// at the head. Invalid ways sit at the tail in index order, so they are
+// filled before any valid way is evicted. Stamps are 64 bit and never wrap.
+class LruReplacement final : public ReplacementPolicy {
+public:
+  void init(uint32_t setNum, uint32_t ways, uint32_t strideBits) override;
+
+  // Make line the most recently used of its set. Lines touched with the
+  // same stamp are ordered by way index, the lowest one being evicted first.
+  void touch(uint32_t line, uint32_t addr, uint64_t stamp) override;
+  void insert(uint32_t line, uint32_t addr, uint64_t stamp) override {
+    touch(line, addr, stamp);
+  }
+  // Move line behind every valid way, it becomes the next victim
+  void invalidate(uint32_t line) override;
+
+  uint32_t victim(uint32_t id) override {
+    return (id << this->strideBits) + this->tail[id];
+  }
+  uint64_t getStamp(uint32_t line) const override {
+    return this->stamps[line] ? this->stamps[line] - 1 : 0;
+  }
+
+private:
+  static const uint16_t NIL = 0xFFFF;
+
+  void unlink(uint32_t id, uint16_t way);
+  void insertBefore(uint32_t id, uint16_t way, uint16_t pos);
+
+  uint32_t strideBits;
+  std::vector<uint16_t> prev, next;  // per line, way indices in the set
+  std::vector<uint16_t> head, tail;  // per set
+  std::vector<uint64_t> stamps;      // per line, 0 while invalid
+};
+
+// First in, first out per set through a round-robin pointer. Invalid ways
+// are filled in index order, so once a set is full the pointer always
+// names its oldest fill. Works at any associativity without allocating.
+class FifoReplacement final : public ReplacementPolicy {
+public:
+  void init(uint32_t setNum, uint32_t ways, uint32_t strideBits) override {
+    this->ways = ways;
+    this->strideBits = strideBits;
+    this->pointer = std::vector<uint32_t>(setNum, 0);
+  }
+  void touch(uint32_t line, uint32_t addr, uint64_t stamp) override {}
+  void insert(uint32_t line, uint32_t addr, uint64_t stamp) override {}
+  void invalidate(uint32_t line) override {}
+  uint32_t victim(uint32_t id) override {
+    uint32_t way = this->pointer[id];
+    this->pointer[id] = way + 1 == this->ways ? 0 : way + 1;
+    return (id << this->strideBits) + way;
+  }
+
+private:
+  uint32_t ways, strideBits;
+  std::vector<uint32_t> pointer;  // per set, next way to evict
+};
+
+// Tree pseudo-LRU. Each set keeps ways - 1 direction bits laid out as a
+// binary heap, every bit points towards the less recently used half.
+// Requires a power of two associativity.
+class PlruReplacement final : public ReplacementPolicy {
+public:
+  void init(uint32_t setNum, uint32_t ways, uint32_t strideBits) override;
+  void touch(uint32_t line, uint32_t addr, uint64_t stamp) override;
+  void insert(uint32_t line, uint32_t addr, uint64_t stamp) override {
+    touch(line, addr, stamp);
+  }
+  void invalidate(uint32_t line) override {}
+  uint32_t victim(uint32_t id) override;
+
+private:
+  uint32_t ways, strideBits;
+  std::vector<uint8_t> bits;  // per set, nodes 1 .. ways-1 of the heap
+};
+
+// Not recently used: one reference bit per way. A hit sets the bit, and
+// once every way of the set is referenced all other bits are cleared. The
+// victim is the first way whose bit is clear.
+class NruReplacement final : public ReplacementPolicy {
+public:
+  void init(uint32_t setNum, uint32_t ways, uint32_t strideBits) override;
+  void touch(uint32_t line, uint32_t addr, uint64_t stamp) override;
+  void insert(uint32_t line, uint32_t addr, uint64_t stamp) override {
+    touch(line, addr, stamp);
+  }
+  void invalidate(uint32_t line) override;
+  uint32_t victim(uint32_t id) override;
+
+private:
+  uint32_t ways, words, strideBits;
+  std::vector<uint64_t> referenced;  // per set, words x 64 bits
+  std::vector<uint32_t> count;       // per set, referenced ways
+};
+
+// Uniformly random victim from a fixed-seed xorshift generator, so runs
+// are reproducible.
+class RandomReplacement final : public ReplacementPolicy {
+public:
+  void init(uint32_t setNum, uint32_t ways, uint32_t strideBits) override;
+  void touch(uint32_t line, uint32_t addr, uint64_t stamp) override {}
+  void insert(uint32_t line, uint32_t addr, uint64_t stamp) override {}
+  void invalidate(uint32_t line) override {}
+  uint32_t victim(uint32_t id) override {
+    this->state ^= this->state << 13;
+    this->state ^= this->state >> 7;
+    this->state ^= this->state << 17;
+    return (id << this->strideBits) + uint32_t(this->state % this->ways);
+  }
+
+private:
+  uint32_t ways, strideBits;
+  uint64_t state;
+};
+
+// Re-reference interval prediction (Jaleel et al., ISCA 2010) with 2-bit
+// RRPVs. A hit predicts a near re-reference (0), the victim is the first
+// way predicted distant (3), ageing the whole set until one exists.
+//  - SRRIP inserts with a long interval (2), so scans cannot flush lines
+//    that were hit before.
+//  - BRRIP inserts distant and only every 32nd fill long, which keeps part
+//    of a thrashing working set resident.
+//  - DRRIP duels the two: SRRIP and BRRIP leader sets count their misses
+//    in a saturating PSEL counter and follower sets use the policy that
+//    currently misses less. A cache of a single set has no room for the
+//    leaders and runs SRRIP.
+class RripReplacement final : public ReplacementPolicy {
+public:
+  enum Mode { SRRIP, BRRIP, DRRIP };
+
+  explicit RripReplacement(Mode mode) : mode(mode) {}
+
+  void init(uint32_t setNum, uint32_t ways, uint32_t strideBits) override;
+  void touch(uint32_t line, uint32_t addr, uint64_t stamp) override {
+    this->rrpv[line] = 0;
+  }
+  void insert(uint32_t line, uint32_t addr, uint64_t stamp) override;
+  void invalidate(uint32_t line) override { this->rrpv[line] = MAX_RRPV; }
+  uint32_t victim(uint32_t id) override;
+  uint64_t getStamp(uint32_t line) const override { return this->rrpv[line]; }
+
+private:
+  static const uint8_t MAX_RRPV = 3;
+  static const uint32_t BIMODAL_PERIOD = 32;
+  static const uint32_t LEADER_SETS = 32;   // per policy
+  static const uint32_t PSEL_MAX = 1023;    // 10-bit counter
+
+  enum SetRole : uint8_t { FOLLOWER, SRRIP_LEADER, BRRIP_LEADER };
+
+  Mode mode;
+  uint32_t ways, strideBits;
+  std::vector<uint8_t> rrpv;   // per line
+  std::vector<uint8_t> role;   // per set, DRRIP only
+  uint32_t bimodalCounter;
+  uint32_t psel;
+};
+
+// Future knowledge for Belady's OPT, built by a pre-pass over the trace.
+// Time is the index of the trace record being simulated, which the driver
+// advances through setPosition().
+class TraceOracle {
+public:
+  static const uint64_t NEVER = UINT64_MAX;
+
+  explicit TraceOracle(uint32_t blockSize);
+
+  // Pre-pass, called once per record in trace order
+  void addAccess(uint32_t addr);
+  void finish();
+
+  void setPosition(uint64_t pos) { this->now = pos; }
+  uint64_t getPosition() const { return this->now; }
+  uint32_t getBlockSize() const { return 1u << this->offsetBits; }
+  // First position after the current one that accesses the block of addr
+  uint64_t nextUse(uint32_t addr) const;
+
+private:
+  uint32_t offsetBits;
+  uint64_t now;
+  std::vector<uint32_t> blocks;      // block of every record
+  std::vector<uint32_t> nextSame;    // next record with the same block
+  std::unordered_map<uint32_t, std::vector<uint32_t>> positions;
+};
+
+// Belady's MIN: evict the line whose block is used again furthest in the
+// future. Each set keeps its lines ordered by next use, so updates and
+// victim selection are O(log ways). Next uses come from the trace as seen
+// by the program, which for lower levels is the usual approximation since
+// the stream reaching them depends on the levels above. A line not touched
+// since its predicted use is re-predicted before it can be kept.
+class OptReplacement final : public ReplacementPolicy {
+public:
+  explicit OptReplacement(const TraceOracle *oracle) : oracle(oracle) {}
+
+  void init(uint32_t setNum, uint32_t ways, uint32_t strideBits) override;
+  void touch(uint32_t line, uint32_t addr, uint64_t stamp) override;
+  void insert(uint32_t line, uint32_t addr, uint64_t stamp) override {
+    touch(line, addr, stamp);
+  }
+  void invalidate(uint32_t line) override;
+  uint32_t victim(uint32_t id) override;
+  uint64_t getStamp(uint32_t line) const override {
+    return this->nextUse[line];
+  }
+
+private:
+  typedef std::set<std::pair<uint64_t, uint32_t>> Order;
+
+  void update(uint32_t line, uint64_t next);
+
+  const TraceOracle *oracle;
+  uint32_t strideBits;
+  std::vector<Order> order;          // per set, (next use, line)
+  std::vector<uint64_t> nextUse;     // per line
+  std::vector<uint32_t> blockAddr;   // per line
+  std::vector<uint8_t> tracked;      // per line, present in order
+};
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef TAG_MATCH_H
+#define TAG_MATCH_H
+
+#include <cstdint>
+
+// Tag value stored in invalid lines. It can never equal a real tag as long
+// as at least one address bit is used for offset or index.
+const uint32_t INVALID_TAG = 0xFFFFFFFF;
+
+// Returns the first i in [0, n) with tags[i] == tag, or -1
+typedef int32_t (*TagMatchFunc)(const uint32_t *tags, uint32_t n, uint32_t tag);
+
+int32_t tagMatchScalar(const uint32_t *tags, uint32_t n, uint32_t tag);
+
+// Picks the widest tag comparison the host CPU supports for sets of the
+// given associativity, narrow sets always use the scalar loop
+TagMatchFunc selectTagMatch(uint32_t associativity);
+const char *tagMatchName(TagMatchFunc func);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef TRACE_DECOMPRESSOR_H
+#define TRACE_DECOMPRESSOR_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum TraceCompression {
+  TRACE_PLAIN = 0,
+  TRACE_GZIP,
+  TRACE_ZSTD,
+  TRACE_XZ,
+};
+
+const char *traceCompressionName(TraceCompression compression);
+// Tells the format from the magic at the start of a stream
+TraceCompression detectTraceCompression(const char *data, size_t size);
+// False when the simulator was built without the library for it
+bool traceCompressionSupported(TraceCompression compression);
+
+// Decompresses a trace on a background thread into a ring of buffers, so
+// the simulation thread only copies out decompressed bytes. The input is
+// the bytes at input followed by whatever can be read from fd.
+class TraceDecompressor {
+public:
+  TraceDecompressor(TraceCompression compression, const char *input,
+                    size_t inputSize, int fd);
+  ~TraceDecompressor();
+
+  // Copy up to size decompressed bytes to dst, waits for the thread when
+  // none are ready. Returns 0 once the stream ends.
+  size_t read(char *dst, size_t size);
+
+  static const uint32_t RING_BUFFERS = 4;
+  static const size_t RING_BUFFER_SIZE = 1 << 20;  // bytes
+
+private:
+  struct RingBuffer {
+    std::vector<char> data;
+    size_t size;
+  };
+
+  void run();
+  // Next piece of input for the decoder, at *data, 0 at its end. Bytes
+  // read from fd go to chunk.
+  size_t readInput(const char **data, std::vector<char> &chunk);
+  // Hand the filled buffer to the reader and wait for a free one, false
+  // when the reader is gone
+  bool publish(size_t size);
+  bool inflateGzip();
+  bool decodeZstd();
+  bool decodeXz();
+
+  TraceCompression compression;
+  const char *input;
+  size_t inputSize;
+  int fd;
+
+  std::vector<RingBuffer> ring;
+  uint32_t head = 0;   // next buffer the thread fills
+  uint32_t tail = 0;   // buffer the reader copies from
+  uint32_t filled = 0;
+  size_t tailPos = 0;
+  bool finished = false;
+  bool stopped = false;
+  std::mutex lock;
+  std::condition_variable hasData, hasSpace;
+  std::thread thread;
+};
+
+#endif
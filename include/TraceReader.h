@@ -0,0 +1,106 @@
+#ifndef TRACE_READER_H
+#define TRACE_READER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <vector>
+
+#include "TraceDecompressor.h"
+
+// One memory access of a trace file
+struct TraceRecord {
+  char op;        // 'r' for read, 'w' for write
+  char type;      // 'I' for instruction, 'D' for data, 0 when not given
+  uint8_t size;   // bytes accessed, 0 when not given
+  uint32_t addr;
+  uint32_t pc;    // instruction address, 0 when the trace carries none
+};
+
+// Binary traces start with a TRACE_HEADER_SIZE byte header: magic "CTRC",
+// version (16 bits), flags (16 bits), record size (32 bits), 4 reserved
+// bytes and the record count (64 bits). Fixed size records follow: op,
+// type and size bytes, a reserved byte, the address as its difference to
+// the previous address modulo 2^32 and, with TRACE_HAS_PC, the PC. All
+// fields are little endian.
+static const uint32_t TRACE_HEADER_SIZE = 24;
+static const uint16_t TRACE_FORMAT_VERSION = 1;
+static const uint16_t TRACE_HAS_PC = 1;
+
+// Records the simulators decode per call to TraceReader::next
+static const size_t TRACE_BATCH = 4096;
+
+// Sequential reader for both trace formats, told apart by the magic. Text
+// traces have one "<op> <hex address> [I|D] [<hex pc>]" per line. Blank
+// lines are skipped, as are malformed ones after reporting their line
+// number on stderr.
+//
+// Regular files are mapped and decoded in place, with the kernel told to
+// read ahead sequentially, so repeated runs over a trace are served from
+// the page cache without copies. Other inputs, or files that cannot be
+// mapped, are read through a buffer. The path "-" reads stdin.
+//
+// Input compressed with gzip, zstd or xz, told apart by its magic, is
+// decompressed by a TraceDecompressor thread ahead of the parsing.
+class TraceReader {
+public:
+  ~TraceReader() { this->close(); }
+
+  bool open(const char *path);
+  bool next(TraceRecord &record);
+  // Decode up to count records, returns how many, 0 once the trace ends
+  size_t next(TraceRecord *records, size_t count);
+  void close();
+  bool isBinary() const { return this->binary; }
+  bool hasPc() const { return this->flags & TRACE_HAS_PC; }
+  // Pipes, FIFOs and terminals can only be read once
+  bool isStream() const { return this->stream; }
+  uint64_t getMalformedLines() const { return this->malformedLines; }
+  // Count malformed lines without reporting them, for a second pass
+  void setQuiet(bool quiet) { this->quiet = quiet; }
+
+  static const uint64_t MAX_REPORTED_LINES = 10;
+
+private:
+  bool nextText(TraceRecord &record);
+  bool nextBinary(TraceRecord &record);
+  void reportMalformed(const char *line, const char *lineEnd);
+  // Make more input available after end, false when there is none
+  bool fill();
+
+  // Input bytes [pos, end) are at data: the whole mapping, or buffer
+  const char *data = nullptr;
+  size_t pos = 0, end = 0;
+  void *mapping = nullptr;
+  size_t mappingSize = 0;
+  int fd = -1;  // while reading through buffer
+  std::vector<char> buffer;
+  TraceDecompressor *decompressor = nullptr;
+  std::vector<char> compressedHead;  // input read before the format was known
+
+  bool binary = false;
+  bool stream = false;
+  uint16_t flags = 0;
+  uint32_t recordSize = 0;
+  uint64_t recordsLeft = 0;
+  uint32_t lastAddr = 0;
+  uint64_t lineNumber = 0;
+  uint64_t malformedLines = 0;
+  bool quiet = false;
+};
+
+// Writes the binary format. The record count is filled in by close().
+class TraceWriter {
+public:
+  bool open(const char *path, bool withPc);
+  void write(const TraceRecord &record);
+  bool close();
+
+private:
+  std::ofstream file;
+  uint16_t flags = 0;
+  uint64_t count = 0;
+  uint32_t lastAddr = 0;
+};
+
+#endif
@@ -1,183 +1,773 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #include "Cache.h"
 
-#define PREFETCHING 1
-#define FIFO 2
-#define VICTIM 3
+static const char *inclusionNames[] = {"nine", "inclusive", "exclusive"};
+
+const char *inclusionName(InclusionPolicy policy) {
+  return inclusionNames[policy];
+}
+
+bool parseInclusion(const char *name, InclusionPolicy *policy) {
+  for (uint32_t i = 0; i < sizeof(inclusionNames) / sizeof(char *); ++i) {
+    if (strcmp(name, inclusionNames[i]) == 0) {
+      *policy = InclusionPolicy(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+static const char *writePolicyNames[] = {"back", "through"};
+static const char *writeMissPolicyNames[] = {"allocate", "no-allocate"};
+
+const char *writePolicyName(WritePolicy policy) {
+  return writePolicyNames[policy];
+}
+
+bool parseWritePolicy(const char *name, WritePolicy *policy) {
+  for (uint32_t i = 0; i < sizeof(writePolicyNames) / sizeof(char *); ++i) {
+    if (strcmp(name, writePolicyNames[i]) == 0) {
+      *policy = WritePolicy(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *writeMissPolicyName(WriteMissPolicy policy) {
+  return writeMissPolicyNames[policy];
+}
+
+bool parseWriteMissPolicy(const char *name, WriteMissPolicy *policy) {
+  for (uint32_t i = 0; i < sizeof(writeMissPolicyNames) / sizeof(char *);
+       ++i) {
+    if (strcmp(name, writeMissPolicyNames[i]) == 0) {
+      *policy = WriteMissPolicy(i);
+      return true;
+    }
+  }
+  return false;
+}
 
 Cache::Cache(MemoryManager *manager, Policy policy, Cache *lowerCache, int tech) {
   this->referenceCounter = 0;
+  this->clock = 0;
+  this->completion = 0;
+  this->writeBufferFree = 0;
+  this->pendingRefill = -1;
+  this->fillDirty = false;
+  this->fillBlock = NO_LINE;
+  this->fillState = 0;
+  this->fillData = nullptr;
+  this->fillLost = false;
   this->memory = manager;
   this->policy = policy;
   this->lowerCache = lowerCache;
+  this->tech = tech;
+  // Older callers select FIFO through tech rather than the policy
+  if (tech == FIFO) this->policy.replacement = REPLACE_FIFO;
+  if (tech == VICTIM && this->policy.victimEntries == 0)
+    this->policy.victimEntries = DEFAULT_VICTIM_ENTRIES;
+  if (tech == PREFETCHING && this->policy.prefetcher == PREFETCH_NONE)
+    this->policy.prefetcher = PREFETCH_STRIDE;
   if (!this->isPolicyValid()) {
     fprintf(stderr, "Policy invalid!\n");
     exit(-1);
   }
+  if (lowerCache != nullptr &&
+      lowerCache->policy.inclusion != INCLUSION_NINE &&
+      lowerCache->policy.blockSize != this->policy.blockSize) {
+    fprintf(stderr, "Inclusion policy %s needs equal block sizes\n",
+            inclusionName(lowerCache->policy.inclusion));
+    exit(-1);
+  }
+  // Stores sent through would leave a copy in the level below
+  if (lowerCache != nullptr &&
+      lowerCache->policy.inclusion == INCLUSION_EXCLUSIVE &&
+      this->policy.writePolicy == WRITE_THROUGH) {
+    fprintf(stderr, "Write-through needs a non-exclusive level below\n");
+    exit(-1);
+  }
+  this->initAddressBits();
   this->initCache();
+  if (lowerCache != nullptr) lowerCache->upperCaches.push_back(this);
+  this->inclusiveBelow =
+      lowerCache != nullptr &&
+      (lowerCache->policy.inclusion == INCLUSION_INCLUSIVE ||
+       lowerCache->inclusiveBelow);
   this->statistics.numRead = 0;
   this->statistics.numWrite = 0;
   this->statistics.numHit = 0;
   this->statistics.numMiss = 0;
   this->statistics.totalCycles = 0;
+  this->statistics.numVictimHit = 0;
+  this->statistics.numVictimMiss = 0;
+  this->statistics.victimCycles = 0;
+  this->statistics.numPrefetch = 0;
+  this->statistics.numPrefetchUseful = 0;
+  this->statistics.numPrefetchLate = 0;
+  this->statistics.numPrefetchPolluting = 0;
+  this->statistics.prefetchLateCycles = 0;
+  this->statistics.elapsedCycles = 0;
+  this->statistics.numMshrMerged = 0;
+  this->statistics.numMshrStalls = 0;
+  this->statistics.numBackInvalidation = 0;
+  this->statistics.numWriteThrough = 0;
+  this->statistics.numWriteCombined = 0;
+  this->statistics.numWriteBufferStalls = 0;
+  this->statistics.numWriteBufferDrains = 0;
+  this->statistics.writeBufferOccupancy = 0;
+  this->statistics.writeBufferPeak = 0;
+}
 
-  this->tech = tech;
-  this->previous_stride = 0;
-  this->tripleSame = 0; this->tripleDiff = 0;
-  this->previous_address = 0;
+Cache::~Cache() {
+  delete this->replacement;
+  delete this->prefetcher;
+  delete this->streams;
 }
 
 bool Cache::inCache(uint32_t addr) {
   return getBlockId(addr) != -1 ? true : false;
 }
 
-void Cache::handlePrefetching(uint32_t addr) {
-  this->stride = addr - this->previous_address;
-  if (this->stride == this->previous_stride)
-  {
-    this->tripleSame++;
-    this->tripleDiff = 0;
-  } else {
-    this->tripleSame = 0;
-    this->tripleDiff++;
-  }
-
-  previous_address = addr;
-  previous_stride = stride;
+void Cache::handlePrefetching(uint32_t addr, uint32_t pc, bool miss) {
+  this->prefetcher->observe(addr, pc, miss, this->prefetchCandidates);
+}
 
-  if (!this->is_prefetch && this->tripleSame >= 3)
-  {
-    this->is_prefetch = true;
-    prefetch(addr+stride);
+// Prefetches and stream refills are issued once the demand access is done
+// with its line. They can then never evict it, nor have an inclusive level
+// below back-invalidate it. Above an inclusive level they also wait for
+// the levels above to finish filling the block, then go out with theirs.
+void Cache::issuePrefetches() {
+  if (this->inclusiveBelow && this->upperFilling()) return;
+  if (this->pendingRefill != -1) {
+    this->refillStream(this->pendingRefill);
+    this->pendingRefill = -1;
   }
-  if (this->is_prefetch && this->tripleDiff >= 3)
-  {
-    this->is_prefetch = false;
+  for (uint32_t target : this->prefetchCandidates) prefetch(target);
+  this->prefetchCandidates.clear();
+  if (this->inclusiveBelow) this->lowerCache->issuePrefetches();
+}
+
+bool Cache::upperFilling() const {
+  for (const Cache *upper : this->upperCaches) {
+    if (upper->fillBlock != NO_LINE || upper->upperFilling()) return true;
   }
-  if (this->is_prefetch) prefetch(addr+stride);
+  return false;
 }
 
 void Cache::prefetch(uint32_t addr)
 {
   if(!this->memory->isPageExist(addr)) this->memory->addPage(addr);
 
-  if (this->getBlockId(addr) != -1) return;
-  this->loadBlockFromLowerLevel(addr, nullptr);
+  uint32_t blockAddr = this->getBlockAddr(addr);
+  if (this->holdsBlock(addr) || this->findInFlight(blockAddr) != -1) return;
+  int32_t entry = -1;
+  for (uint32_t i = 0; i < this->inFlight.size() && entry == -1; ++i) {
+    if (!this->inFlight[i].valid) entry = i;
+  }
+  // Dropped while the queue is full
+  if (entry == -1) return;
+  this->statistics.numPrefetch++;
+  this->takePolluted(blockAddr);
+  uint8_t *data = this->policy.tagOnly
+                      ? nullptr
+                      : &this->inFlightData[size_t(entry) * this->policy.blockSize];
+  // Entered before the fetch, which may have an inclusive level below
+  // evict the block again and back-invalidate the request
+  this->inFlight[entry] = InFlight{blockAddr, UINT64_MAX, true};
+  uint64_t latency = this->fetchBlock(blockAddr, data, nullptr);
+  if (this->inFlight[entry].valid)
+    this->inFlight[entry].ready = this->clock + latency;
   return;
 }
 
-uint32_t Cache::getBlockId(uint32_t addr) {
-  uint32_t tag = this->getTag(addr);
-  uint32_t id = this->getId(addr);
-  // printf("0x%x 0x%x 0x%x\n", addr, tag, id);
-  // iterate over the given set
-  for (uint32_t i = id * policy.associativity;
-       i < (id + 1) * policy.associativity; ++i) {
-    if (this->blocks[i].id != id) {
-      fprintf(stderr, "Inconsistent ID in block %d\n", i);
-      exit(-1);
-    }
-    if (this->blocks[i].valid && this->blocks[i].tag == tag) {
+int32_t Cache::findInFlight(uint32_t blockAddr) {
+  for (uint32_t i = 0; i < this->inFlight.size(); ++i) {
+    if (this->inFlight[i].valid && this->inFlight[i].blockAddr == blockAddr)
       return i;
+  }
+  return -1;
+}
+
+// Fill the prefetches that have arrived by now, in arrival order. Only
+// demand requests retire them, never the write-backs an upper level sends
+// while it fills a line: a fill here could evict the block it is filling,
+// which would then pass through it without being kept.
+void Cache::retirePrefetches() {
+  if (this->inFlight.empty()) return;
+  for (;;) {
+    int32_t first = -1;
+    for (uint32_t i = 0; i < this->inFlight.size(); ++i) {
+      const InFlight &request = this->inFlight[i];
+      if (request.valid && request.ready <= this->clock &&
+          (first == -1 || request.ready < this->inFlight[first].ready))
+        first = i;
+    }
+    if (first == -1) return;
+    this->completePrefetch(first);
+  }
+}
+
+uint32_t Cache::completePrefetch(uint32_t entry) {
+  this->inFlight[entry].valid = false;
+  const uint8_t *data =
+      this->policy.tagOnly
+          ? nullptr
+          : &this->inFlightData[size_t(entry) * this->policy.blockSize];
+  return this->installBlock(this->inFlight[entry].blockAddr, data,
+                            LINE_VALID | LINE_PREFETCHED);
+}
+
+// Keep buffer full, skipping blocks the cache or another buffer holds
+void Cache::refillStream(uint32_t buffer) {
+  for (uint32_t i = 0;
+       i < this->streams->getDepth() && !this->streams->isFull(buffer); ++i) {
+    uint32_t blockAddr = this->streams->getNext(buffer);
+    if (!this->memory->isPageExist(blockAddr)) this->memory->addPage(blockAddr);
+    if (this->holdsBlock(blockAddr) || this->streams->contains(blockAddr)) {
+      this->streams->skip(buffer);
+      continue;
     }
+    this->statistics.numPrefetch++;
+    uint8_t *data = this->streams->push(buffer);
+    uint64_t latency = this->fetchBlock(blockAddr, data, nullptr);
+    this->streams->setTailReady(buffer, this->clock + latency);
+  }
+}
+
+// MSHR for a miss to the lower level. When all are busy the miss waits
+// for the earliest one to complete.
+uint32_t Cache::allocateMshr() {
+  uint32_t entry = 0;
+  for (uint32_t i = 1; i < this->mshrs.size(); ++i) {
+    if (this->mshrs[i].ready < this->mshrs[entry].ready) entry = i;
+  }
+  if (this->mshrs[entry].ready > this->clock) {
+    this->statistics.numMshrStalls++;
+    this->clock = this->mshrs[entry].ready;
+  }
+  return entry;
+}
+
+int32_t Cache::findMshr(uint32_t blockAddr) {
+  for (uint32_t i = 0; i < this->mshrs.size(); ++i) {
+    if (this->mshrs[i].ready > this->clock &&
+        this->mshrs[i].blockAddr == blockAddr)
+      return i;
   }
   return -1;
 }
 
-uint8_t Cache::getByte(uint32_t addr, uint32_t *cycles, bool countStats) {
-  if (countStats) {
-    this->referenceCounter++;
-    this->statistics.numRead++;
+bool Cache::holdsBlock(uint32_t addr) {
+  return this->getBlockId(addr) != uint32_t(-1) ||
+         this->findVictimEntry(addr) != -1;
+}
+
+uint32_t Cache::pollutionBit(uint32_t blockAddr) const {
+  uint32_t block = blockAddr >> this->policy.offsetBits;
+  return (block ^ (block >> 12)) % POLLUTION_FILTER_BITS;
+}
+
+void Cache::markPolluted(uint32_t blockAddr) {
+  uint32_t bit = this->pollutionBit(blockAddr);
+  this->pollutionFilter[bit / 64] |= uint64_t(1) << (bit % 64);
+}
+
+bool Cache::takePolluted(uint32_t blockAddr) {
+  uint32_t bit = this->pollutionBit(blockAddr);
+  uint64_t mask = uint64_t(1) << (bit % 64);
+  bool polluted = this->pollutionFilter[bit / 64] & mask;
+  this->pollutionFilter[bit / 64] &= ~mask;
+  return polluted;
+}
+
+uint32_t Cache::lookupRuntime(uint32_t addr) {
+  uint32_t tag = this->getTag(addr);
+  uint32_t begin = this->getId(addr) << this->setStrideBits;
+  const uint32_t *setTags = &this->tags[begin];
+  const uint8_t *setStates = &this->states[begin];
+  uint32_t ways = policy.associativity;
+  // Invalid lines hold INVALID_TAG, so the valid check only fails when a
+  // tag spans the whole address and can legitimately equal it
+  uint32_t from = 0;
+  while (from < ways) {
+    int32_t i = this->tagMatch(setTags + from, ways - from, tag);
+    if (i < 0) break;
+    i += from;
+    if (setStates[i] & LINE_VALID) return begin + i;
+    from = i + 1;
   }
- 
-  if (this->tech == PREFETCHING) handlePrefetching(addr);
+  return -1;
+}
 
-  // If in cache, return directly
-  int blockId = this->getBlockId(addr);
-  if (blockId != -1) {
+uint8_t Cache::getByte(uint32_t addr, uint32_t *cycles, bool countStats,
+                       uint32_t pc) {
+  this->retirePrefetches();
+  uint32_t blockId = this->access(addr, false, cycles, countStats, pc);
+  uint8_t val = 0;
+  if (!this->policy.tagOnly) {
+    // A fill lost to a back-invalidation is still in the fill buffer
+    const uint8_t *line = blockId == NO_LINE ? this->fillBuffer.data()
+                                             : this->getLineData(blockId);
+    val = line[this->getOffset(addr)];
+  }
+  this->issuePrefetches();
+  return val;
+}
+
+void Cache::setByte(uint32_t addr, uint8_t val, uint32_t *cycles,
+                    bool countStats, uint32_t pc) {
+  this->retirePrefetches();
+  uint32_t blockId = this->access(addr, true, cycles, countStats, pc);
+  if (blockId != NO_LINE && !this->policy.tagOnly)
+    this->getLineData(blockId)[this->getOffset(addr)] = val;
+  if (blockId == NO_LINE || this->policy.writePolicy == WRITE_THROUGH)
+    this->storeToLowerLevel(addr, 1, &val, cycles, countStats);
+  this->issuePrefetches();
+}
+
+void Cache::readBlock(uint32_t addr, uint32_t size, uint8_t *data,
+                      uint32_t *cycles, bool countStats) {
+  // A request larger than our block spans several of our blocks, only the
+  // first one is counted just like the first byte of a per-byte transfer
+  uint32_t blockSize = this->policy.blockSize;
+  uint32_t end = addr + size;
+  while (addr < end) {
     uint32_t offset = this->getOffset(addr);
+    uint32_t len = std::min(blockSize - offset, end - addr);
+    this->retirePrefetches();
+    uint32_t blockId = this->access(addr, false, cycles, countStats, 0);
+    if (data != nullptr) {
+      if (this->policy.tagOnly)
+        memset(data, 0, len);
+      else if (blockId == NO_LINE)
+        memcpy(data, this->fillBuffer.data() + offset, len);
+      else
+        memcpy(data, this->getLineData(blockId) + offset, len);
+      data += len;
+    }
+    this->issuePrefetches();
+    addr += len;
+    countStats = false;
+  }
+}
+
+bool Cache::takeBlock(uint32_t addr, uint8_t *data, uint32_t *cycles) {
+  uint32_t blockSize = this->policy.blockSize;
+  this->retirePrefetches();
+  uint32_t blockId = this->access(addr, false, cycles, true, 0, false);
+  bool dirty;
+  const uint8_t *source;
+  if (blockId == NO_LINE) {
+    dirty = this->fillDirty;
+    source = this->fillBuffer.data();
+  } else {
+    dirty = this->states[blockId] & LINE_MODIFIED;
+    source = this->policy.tagOnly ? nullptr : this->getLineData(blockId);
+  }
+  if (data != nullptr) {
+    if (this->policy.tagOnly)
+      memset(data, 0, blockSize);
+    else
+      memcpy(data, source, blockSize);
+  }
+  if (blockId != NO_LINE) this->invalidateLine(blockId);
+  this->issuePrefetches();
+  return dirty;
+}
+
+// A copy may be here already when a prefetch from above read the block
+void Cache::insertBlock(uint32_t addr, const uint8_t *data, bool dirty) {
+  uint32_t blockAddr = this->getBlockAddr(addr);
+  int32_t request = this->findInFlight(blockAddr);
+  if (request != -1) this->completePrefetch(request);
+  int32_t blockId = this->getBlockId(addr);
+  if (blockId == -1) {
+    int32_t entry = this->findVictimEntry(addr);
+    if (entry != -1) blockId = this->swapFromVictimBuffer(addr, entry);
+  }
+  if (blockId == -1) {
+    this->installBlock(addr, data,
+                       dirty ? LINE_VALID | LINE_MODIFIED : LINE_VALID);
+  } else {
+    if (data != nullptr && !this->policy.tagOnly)
+      memcpy(this->getLineData(blockId), data, this->policy.blockSize);
+    this->states[blockId] &= ~LINE_PREFETCHED;
+    if (dirty) this->states[blockId] |= LINE_MODIFIED;
+    this->replacement->touch(blockId, blockAddr, this->referenceCounter);
+  }
+}
+
+void Cache::writeBlock(uint32_t addr, uint32_t size, const uint8_t *data,
+                       uint32_t *cycles, bool countStats) {
+  // Write-backs from the upper level are never counted as accesses
+  uint32_t blockSize = this->policy.blockSize;
+  uint32_t end = addr + size;
+  while (addr < end) {
+    uint32_t offset = this->getOffset(addr);
+    uint32_t len = std::min(blockSize - offset, end - addr);
+    uint32_t blockId = this->access(addr, true, cycles, countStats, 0);
+    if (data != nullptr && blockId != NO_LINE && !this->policy.tagOnly)
+      memcpy(this->getLineData(blockId) + offset, data, len);
+    if (blockId == NO_LINE || this->policy.writePolicy == WRITE_THROUGH)
+      this->storeToLowerLevel(addr, len, data, cycles, countStats);
+    if (data != nullptr) data += len;
+    this->issuePrefetches();
+    addr += len;
+    countStats = false;
+  }
+}
+
+// A store leaving this level, because it is write-through or the store
+// missed without allocating. Without a write buffer it waits for the level
+// below like a miss, otherwise only for a free buffer entry.
+void Cache::storeToLowerLevel(uint32_t addr, uint32_t size,
+                              const uint8_t *data, uint32_t *cycles,
+                              bool countStats) {
+  uint64_t start = this->clock;
+  // Where later accesses resume under MSHRs, past a stall for a free
+  // buffer entry so that its wait is charged only once
+  uint64_t resume = start;
+  if (countStats) this->statistics.numWriteThrough++;
+  if (!this->writeBuffer.empty()) {
+    this->bufferStore(addr, size, data, countStats);
+    resume = this->clock;
+  } else {
     if (countStats) {
-      this->statistics.numHit++;
-      this->statistics.totalCycles += this->policy.hitLatency;
-      // this->blocks[blockId].lastReference = this->referenceCounter;
-      if (cycles) *cycles = this->policy.hitLatency;
+      this->statistics.totalCycles += this->policy.missLatency;
+      this->clock += this->policy.missLatency;
+    }
+    uint64_t latency = this->writeToLowerLevel(addr, size, data, nullptr,
+                                               countStats, this->clock);
+    if (countStats) this->clock += latency;
+  }
+  if (countStats) {
+    if (cycles) *cycles += this->clock - start;
+    if (this->clock > this->completion) this->completion = this->clock;
+    if (this->completion > this->statistics.elapsedCycles)
+      this->statistics.elapsedCycles = this->completion;
+    if (!this->mshrs.empty()) this->clock = resume;
+  }
+}
+
+// Merge the store into the entry of its block, or take a new entry,
+// waiting for the oldest one to leave when all are in use
+void Cache::bufferStore(uint32_t addr, uint32_t size, const uint8_t *data,
+                        bool countStats) {
+  uint32_t blockSize = this->policy.blockSize;
+  uint32_t blockAddr = this->getBlockAddr(addr);
+  this->retireWriteBuffer();
+  int32_t entry = -1;
+  for (uint32_t i = 0; i < this->writeBuffer.size() && entry == -1; ++i) {
+    if (this->writeBuffer[i].valid && this->writeBuffer[i].blockAddr == blockAddr)
+      entry = i;
+  }
+  if (entry != -1) {
+    if (countStats) this->statistics.numWriteCombined++;
+  } else {
+    for (uint32_t i = 0; i < this->writeBuffer.size() && entry == -1; ++i) {
+      if (!this->writeBuffer[i].valid) entry = i;
+    }
+    if (entry == -1) {
+      entry = this->oldestWriteEntry();
+      uint64_t start = std::max(this->writeBufferFree,
+                                this->writeBuffer[entry].arrival);
+      if (countStats) {
+        this->statistics.numWriteBufferStalls++;
+        this->statistics.totalCycles += start - this->clock;
+        this->clock = start;
+      }
+      this->drainWriteEntry(entry, start);
     }
-    this->blocks[blockId].lastReference = this->referenceCounter;
-    return this->blocks[blockId].data[offset];
+    this->writeBuffer[entry] = WriteEntry{blockAddr, this->clock, false, true};
+    memset(&this->writeBufferMask[size_t(entry) * blockSize], 0, blockSize);
   }
+  uint32_t offset = this->getOffset(addr);
+  this->writeBuffer[entry].counted |= countStats;
+  memset(&this->writeBufferMask[size_t(entry) * blockSize + offset], 1, size);
+  if (data != nullptr && !this->policy.tagOnly)
+    memcpy(&this->writeBufferData[size_t(entry) * blockSize + offset], data,
+           size);
 
-  // Else, find the data in memory or other level of cache
   if (countStats) {
-    this->statistics.numMiss++;
-    this->statistics.totalCycles += this->policy.missLatency;
-    if (cycles) *cycles = this->policy.missLatency;
+    uint32_t used = 0;
+    for (const WriteEntry &buffered : this->writeBuffer) used += buffered.valid;
+    this->statistics.writeBufferOccupancy += used;
+    if (used > this->statistics.writeBufferPeak)
+      this->statistics.writeBufferPeak = used;
   }
-  
-  this->loadBlockFromLowerLevel(addr, cycles);
-  blockId = this->getBlockId(addr);
-  this->blocks[blockId].lastReference = this->referenceCounter;
-  return blocks[blockId].data[this->getOffset(addr)];
-
-  // The block is in top level cache now, return directly
-  // if ((blockId = this->getBlockId(addr)) != -1) {
-  //   uint32_t offset = this->getOffset(addr);
-  //   this->blocks[blockId].lastReference = this->referenceCounter;
-  //   return this->blocks[blockId].data[offset];
-  // } else {
-  //   fprintf(stderr, "Error: data not in top level cache!\n");
-  //   exit(-1);
-  // }
-}
-
-void Cache::setByte(uint32_t addr, uint8_t val, uint32_t *cycles, bool countStats) {
+}
+
+// Write out, oldest first, the entries the level below could take by now
+void Cache::retireWriteBuffer() {
+  for (;;) {
+    int32_t oldest = this->oldestWriteEntry();
+    if (oldest == -1) return;
+    uint64_t start = std::max(this->writeBufferFree,
+                              this->writeBuffer[oldest].arrival);
+    if (start > this->clock) return;
+    this->drainWriteEntry(oldest, start);
+  }
+}
+
+int32_t Cache::oldestWriteEntry() {
+  int32_t oldest = -1;
+  for (uint32_t i = 0; i < this->writeBuffer.size(); ++i) {
+    const WriteEntry &entry = this->writeBuffer[i];
+    if (entry.valid &&
+        (oldest == -1 || entry.arrival < this->writeBuffer[oldest].arrival))
+      oldest = i;
+  }
+  return oldest;
+}
+
+void Cache::drainWriteEntry(uint32_t entry, uint64_t start) {
+  uint32_t blockSize = this->policy.blockSize;
+  WriteEntry &buffered = this->writeBuffer[entry];
+  buffered.valid = false;
+  this->statistics.numWriteBufferDrains++;
+  const uint8_t *data =
+      this->policy.tagOnly
+          ? nullptr
+          : &this->writeBufferData[size_t(entry) * blockSize];
+  this->writeBufferFree =
+      start + this->writeToLowerLevel(
+                  buffered.blockAddr, blockSize, data,
+                  &this->writeBufferMask[size_t(entry) * blockSize],
+                  buffered.counted, start);
+}
+
+// Stores buffered for a block leaving this level or one above merge into
+// its data, if given, and leave the buffer. Returns whether there were any.
+bool Cache::mergeWriteEntry(uint32_t blockAddr, uint8_t *data) {
+  uint32_t blockSize = this->policy.blockSize;
+  bool merged = false;
+  for (uint32_t i = 0; i < this->writeBuffer.size(); ++i) {
+    WriteEntry &buffered = this->writeBuffer[i];
+    if (!buffered.valid || buffered.blockAddr != blockAddr) continue;
+    merged = true;
+    buffered.valid = false;
+    if (data != nullptr && !this->policy.tagOnly) {
+      const uint8_t *mask = &this->writeBufferMask[size_t(i) * blockSize];
+      const uint8_t *bytes = &this->writeBufferData[size_t(i) * blockSize];
+      for (uint32_t j = 0; j < blockSize; ++j) {
+        if (mask[j]) data[j] = bytes[j];
+      }
+    }
+  }
+  return merged;
+}
+
+// A block about to be read from the level below must not be older there
+// than in the write buffer
+void Cache::flushWriteEntry(uint32_t blockAddr) {
+  this->retireWriteBuffer();
+  for (uint32_t i = 0; i < this->writeBuffer.size(); ++i) {
+    if (this->writeBuffer[i].valid &&
+        this->writeBuffer[i].blockAddr == blockAddr) {
+      this->drainWriteEntry(i, std::max(this->writeBufferFree, this->clock));
+      return;
+    }
+  }
+}
+
+// Send the bytes of [addr, addr + size) to the level below, only those set
+// in mask when one is given, as a request arriving there at cycle now.
+// Returns its latency, 0 for an uncounted request to a cache.
+uint64_t Cache::writeToLowerLevel(uint32_t addr, uint32_t size,
+                                  const uint8_t *data, const uint8_t *mask,
+                                  bool countStats, uint64_t now) {
+  if (this->lowerCache != nullptr) this->lowerCache->clock = now;
+  bool first = countStats;
+  for (uint32_t i = 0; i < size;) {
+    if (mask != nullptr && !mask[i]) {
+      ++i;
+      continue;
+    }
+    uint32_t j = i + 1;
+    while (j < size && (mask == nullptr || mask[j])) ++j;
+    const uint8_t *run = data != nullptr ? data + i : nullptr;
+    if (this->lowerCache != nullptr) {
+      this->lowerCache->writeBlock(addr + i, j - i, run, nullptr, first);
+      first = false;
+    } else if (run != nullptr) {
+      for (uint32_t k = 0; k < j - i; ++k)
+        this->memory->setByteNoCache(addr + i + k, run[k]);
+    }
+    i = j;
+  }
+  if (this->lowerCache != nullptr)
+    return countStats ? this->lowerCache->completion - now : 0;
+  if (this->policy.dram != nullptr)
+    return this->policy.dram->access(this->getBlockAddr(addr), true, now);
+  return MEMORY_LATENCY;
+}
+
+// A miss with allocate false leaves the block in fillBuffer instead of
+// installing it and returns NO_LINE, as does a store missing a
+// no-write-allocate level
+uint32_t Cache::access(uint32_t addr, bool isWrite, uint32_t *cycles,
+                       bool countStats, uint32_t pc, bool allocate) {
   if (countStats) {
     this->referenceCounter++;
-    this->statistics.numWrite++;
+    if (isWrite)
+      this->statistics.numWrite++;
+    else
+      this->statistics.numRead++;
   }
 
-  if (this->tech == PREFETCHING) handlePrefetching(addr);
+  uint64_t issue = this->clock;
 
-  // If in cache, write to it directly
+  // If in cache, use it directly
   int blockId = this->getBlockId(addr);
-  if (blockId!= -1) {
-    uint32_t offset = this->getOffset(addr);
+  uint64_t wait = 0;
+  uint32_t charged = 0;  // part of wait counted in totalCycles
+  if (blockId == -1 && !this->inFlight.empty()) {
+    // Prefetched too late, wait for the rest of its latency
+    int32_t entry = this->findInFlight(this->getBlockAddr(addr));
+    if (entry != -1) {
+      wait = this->inFlight[entry].ready - this->clock;
+      // Charged no more than a miss, the rest is waited in clock only
+      uint32_t limit = this->policy.missLatency > this->policy.hitLatency
+                           ? this->policy.missLatency - this->policy.hitLatency
+                           : 0;
+      charged = uint32_t(wait < limit ? wait : limit);
+      blockId = this->completePrefetch(entry);
+      if (countStats) {
+        this->statistics.numPrefetchLate++;
+        this->statistics.prefetchLateCycles += wait;
+      }
+    }
+  }
+  bool miss = blockId == -1;
+  if (!miss) {
     if (countStats) {
       this->statistics.numHit++;
-      this->statistics.totalCycles += this->policy.hitLatency;
-      // this->blocks[blockId].lastReference = this->referenceCounter;
-      if (cycles) *cycles = this->policy.hitLatency;
+      this->statistics.totalCycles += this->policy.hitLatency + charged;
+      this->clock += this->policy.hitLatency + wait;
+      if (cycles) *cycles = this->policy.hitLatency + charged;
+      // Hit under the miss that brought the line, its data is not there yet
+      int32_t mshr = this->findMshr(this->getBlockAddr(addr));
+      if (mshr != -1 && this->mshrs[mshr].ready > this->clock) {
+        this->statistics.numMshrMerged++;
+        this->clock = this->mshrs[mshr].ready;
+      }
+    }
+    this->replacement->touch(blockId, this->getBlockAddr(addr),
+                             this->referenceCounter);
+  } else {
+    if (countStats) {
+      this->statistics.numMiss++;
+      if (this->takePolluted(this->getBlockAddr(addr)))
+        this->statistics.numPrefetchPolluting++;
+    }
+    // Lines evicted recently may still sit in the victim buffer
+    int32_t entry = this->findVictimEntry(addr);
+    int32_t buffer = -1;
+    if (entry == -1 && this->streams != nullptr)
+      buffer = this->streams->findHead(this->getBlockAddr(addr));
+    if (entry != -1) {
+      if (countStats) {
+        this->statistics.numVictimHit++;
+        this->statistics.victimCycles += this->policy.victimLatency;
+        this->statistics.totalCycles += this->policy.victimLatency;
+        this->clock += this->policy.victimLatency;
+        if (cycles) *cycles = this->policy.victimLatency;
+      }
+      blockId = this->swapFromVictimBuffer(addr, entry);
+    } else if (isWrite && this->policy.writeMiss == WRITE_NO_ALLOCATE) {
+      // The caller sends the store down, a buffered copy would go stale
+      if (countStats) {
+        if (this->policy.victimEntries > 0) this->statistics.numVictimMiss++;
+        this->statistics.totalCycles += this->policy.hitLatency;
+        this->clock += this->policy.hitLatency;
+        if (cycles) *cycles = this->policy.hitLatency;
+      }
+      if (this->streams != nullptr)
+        this->streams->invalidate(this->getBlockAddr(addr));
+      blockId = NO_LINE;
+    } else if (buffer != -1) {
+      // Served by a stream buffer instead of the lower level
+      uint64_t ready = this->streams->getHeadReady(buffer);
+      if (ready > this->clock) wait = ready - this->clock;
+      if (countStats) {
+        this->statistics.numPrefetchUseful++;
+        if (wait > 0) {
+          this->statistics.numPrefetchLate++;
+          this->statistics.prefetchLateCycles += wait;
+        }
+        // Charged like the miss it is, the wait overlaps its latency
+        this->statistics.totalCycles += this->policy.missLatency;
+        this->clock += this->policy.missLatency + wait;
+        if (cycles) *cycles = this->policy.missLatency;
+      }
+      const uint8_t *headData = this->streams->getHeadData(buffer);
+      if (allocate) {
+        blockId = this->installBlock(addr, headData, LINE_VALID);
+      } else {
+        if (headData != nullptr)
+          memcpy(this->fillBuffer.data(), headData, this->policy.blockSize);
+        this->fillDirty = false;
+        this->streams->invalidate(this->getBlockAddr(addr));
+        blockId = NO_LINE;
+      }
+      this->streams->touch(buffer, this->referenceCounter);
+      this->pendingRefill = buffer;
+    } else {
+      // Else, find the data in memory or other level of cache
+      int32_t mshr = -1;
+      if (countStats && !this->mshrs.empty()) {
+        mshr = this->allocateMshr();
+        issue = this->clock;
+      }
+      if (countStats) {
+        if (this->policy.victimEntries > 0) this->statistics.numVictimMiss++;
+        this->statistics.totalCycles += this->policy.missLatency;
+        this->clock += this->policy.missLatency;
+        if (cycles) *cycles = this->policy.missLatency;
+      }
+      blockId = this->loadBlockFromLowerLevel(addr, cycles, allocate);
+      if (mshr != -1)
+        this->mshrs[mshr] = Mshr{this->getBlockAddr(addr), this->clock};
+      if (this->streams != nullptr && countStats) {
+        buffer = this->streams->allocate(
+            this->getBlockAddr(addr) + this->policy.blockSize,
+            this->referenceCounter);
+        this->pendingRefill = buffer;
+      }
     }
-    this->blocks[blockId].modified = true;
-    this->blocks[blockId].lastReference = this->referenceCounter;
-    this->blocks[blockId].data[offset] = val;
-    return;
   }
 
-  // Else, load the data from cache
   if (countStats) {
-    this->statistics.numMiss++;
-    this->statistics.totalCycles += this->policy.missLatency;
-    if (cycles) *cycles = this->policy.missLatency; 
+    this->completion = this->clock;
+    if (this->completion > this->statistics.elapsedCycles)
+      this->statistics.elapsedCycles = this->completion;
+    // Non-blocking, the next access only waits for this lookup
+    if (!this->mshrs.empty()) this->clock = issue + this->policy.hitLatency;
   }
-  
-  this->loadBlockFromLowerLevel(addr, cycles);
-  blockId = this->getBlockId(addr);
-  this->blocks[blockId].modified = true;
-  this->blocks[blockId].lastReference = this->referenceCounter;
-  this->blocks[blockId].data[this->getOffset(addr)] = val;
-
-  // if ((blockId = this->getBlockId(addr)) != -1) {
-  //   uint32_t offset = this->getOffset(addr);
-  //   this->blocks[blockId].modified = true;
-  //   this->blocks[blockId].lastReference = this->referenceCounter;
-  //   this->blocks[blockId].data[offset] = val;
-  //   return;
-  // } else {
-  //   fprintf(stderr, "Error: data not in top level cache!\n");
-  //   exit(-1);
-  // }
+
+  if (uint32_t(blockId) == NO_LINE) {
+    if (countStats && this->prefetcher != nullptr)
+      this->handlePrefetching(addr, pc, miss);
+    return NO_LINE;
+  }
+
+  // First demand use of a prefetched line, it trains like the miss it saved
+  if (countStats && (this->states[blockId] & LINE_PREFETCHED)) {
+    this->statistics.numPrefetchUseful++;
+    this->states[blockId] &= ~LINE_PREFETCHED;
+    miss = true;
+  }
+  if (isWrite && this->policy.writePolicy == WRITE_BACK)
+    this->states[blockId] |= LINE_MODIFIED;
+  if (countStats && this->prefetcher != nullptr)
+    this->handlePrefetching(addr, pc, miss);
+  return blockId;
 }
 
 void Cache::printInfo(bool verbose) {
@@ -188,17 +778,40 @@ void Cache::printInfo(bool verbose) {
   printf("Associativiy: %d\n", this->policy.associativity);
   printf("Hit Latency: %d\n", this->policy.hitLatency);
   printf("Miss Latency: %d\n", this->policy.missLatency);
+  printf("Tag Only: %s\n", this->policy.tagOnly ? "yes" : "no");
+  printf("Tag Match: %s\n", tagMatchName(this->tagMatch));
+  printf("Engine: %s\n", this->fixedEngine ? "fixed geometry" : "runtime");
+  printf("Replacement: %s\n", replacementName(this->policy.replacement));
+  if (this->streams != nullptr)
+    printf("Prefetcher: %d stream buffers of %d blocks\n",
+           this->streams->getCount(), this->streams->getDepth());
+  else if (this->prefetcher != nullptr)
+    printf("Prefetcher: %s\n", prefetcherName(this->policy.prefetcher));
+  if (this->policy.victimEntries > 0)
+    printf("Victim Buffer: %d entries, latency %d\n",
+           this->policy.victimEntries, this->policy.victimLatency);
+  if (this->policy.mshrEntries > 0)
+    printf("MSHRs: %d\n", this->policy.mshrEntries);
+  if (this->policy.inclusion != INCLUSION_NINE)
+    printf("Inclusion: %s\n", inclusionName(this->policy.inclusion));
+  printf("Write Policy: write-%s, %s\n",
+         writePolicyName(this->policy.writePolicy),
+         writeMissPolicyName(this->policy.writeMiss));
+  if (this->policy.writeBufferEntries > 0)
+    printf("Write Buffer: %d entries\n", this->policy.writeBufferEntries);
+  if (this->policy.dram != nullptr) this->policy.dram->printInfo();
 
   if (verbose) {
-    for (int j = 0; j < this->blocks.size(); ++j) {
-      const Block &b = this->blocks[j];
-      printf("Block %d: tag 0x%x id %d %s %s (last ref %d)\n", j, b.tag, b.id,
-             b.valid ? "valid" : "invalid",
-             b.modified ? "modified" : "unmodified", b.lastReference);
-      // printf("Data: ");
-      // for (uint8_t d : b.data)
-      // printf("%d ", d);
-      // printf("\n");
+    uint32_t setNum = policy.blockNum / policy.associativity;
+    for (uint32_t id = 0; id < setNum; ++id) {
+      for (uint32_t i = 0; i < policy.associativity; ++i) {
+        uint32_t line = (id << this->setStrideBits) + i;
+        printf("Block %d: tag 0x%x id %d %s %s (last ref %lu)\n",
+               id * policy.associativity + i, this->tags[line], id,
+               (this->states[line] & LINE_VALID) ? "valid" : "invalid",
+               (this->states[line] & LINE_MODIFIED) ? "modified" : "unmodified",
+               this->replacement->getStamp(line));
+      }
     }
   }
 }
@@ -215,9 +828,58 @@ void Cache::printStatistics() {
   printf("Miss Rate: %.2f%%\n", missRate);
   
   printf("Total Cycles: %lu\n", this->statistics.totalCycles);
+  printf("Elapsed Cycles: %lu\n", this->statistics.elapsedCycles);
+  if (this->policy.mshrEntries > 0) {
+    printf("MSHR Merged: %d\n", this->statistics.numMshrMerged);
+    printf("MSHR Stalls: %d\n", this->statistics.numMshrStalls);
+  }
+  if (this->policy.inclusion == INCLUSION_INCLUSIVE)
+    printf("Back Invalidations: %d\n", this->statistics.numBackInvalidation);
+  if (this->policy.writePolicy == WRITE_THROUGH ||
+      this->policy.writeMiss == WRITE_NO_ALLOCATE)
+    printf("Stores Sent Down: %d\n", this->statistics.numWriteThrough);
+  if (this->policy.writeBufferEntries > 0) {
+    const Statistics &stats = this->statistics;
+    uint32_t buffered = stats.numWriteThrough;
+    printf("Write Buffer Combined: %d\n", stats.numWriteCombined);
+    printf("Write Buffer Drains: %d\n", stats.numWriteBufferDrains);
+    printf("Write Buffer Stalls: %d\n", stats.numWriteBufferStalls);
+    printf("Write Buffer Occupancy: %.2f average, %d peak\n",
+           buffered > 0 ? float(stats.writeBufferOccupancy) / buffered : 0.0f,
+           stats.writeBufferPeak);
+  }
+  if (this->policy.victimEntries > 0) {
+    uint32_t probes =
+        this->statistics.numVictimHit + this->statistics.numVictimMiss;
+    printf("Victim Hit: %d\n", this->statistics.numVictimHit);
+    printf("Victim Miss: %d\n", this->statistics.numVictimMiss);
+    printf("Victim Hit Rate: %.2f%%\n",
+           probes > 0 ? this->statistics.numVictimHit * 100.0f / probes : 0.0f);
+    printf("Victim Cycles: %lu\n", this->statistics.victimCycles);
+  }
+  if (this->prefetcher != nullptr || this->streams != nullptr) {
+    const Statistics &stats = this->statistics;
+    // Stream buffer hits are still misses of the cache itself
+    uint32_t missesLeft = stats.numMiss;
+    if (this->streams != nullptr) missesLeft -= stats.numPrefetchUseful;
+    uint32_t covered = stats.numPrefetchUseful + missesLeft;
+    printf("Prefetch Issued: %d\n", stats.numPrefetch);
+    printf("Prefetch Useful: %d\n", stats.numPrefetchUseful);
+    printf("Prefetch Late: %d\n", stats.numPrefetchLate);
+    printf("Prefetch Late Cycles: %lu\n", stats.prefetchLateCycles);
+    printf("Prefetch Polluting: %d\n", stats.numPrefetchPolluting);
+    printf("Prefetch Accuracy: %.2f%%\n",
+           stats.numPrefetch > 0
+               ? stats.numPrefetchUseful * 100.0f / stats.numPrefetch
+               : 0.0f);
+    printf("Prefetch Coverage: %.2f%%\n",
+           covered > 0 ? stats.numPrefetchUseful * 100.0f / covered : 0.0f);
+  }
   if (this->lowerCache != nullptr) {
     printf("---------- LOWER CACHE ----------\n");
     this->lowerCache->printStatistics();
+  } else if (this->policy.dram != nullptr) {
+    this->policy.dram->printStatistics();
   }
 }
 
@@ -238,103 +900,372 @@ bool Cache::isPolicyValid() {
     fprintf(stderr, "blockNum * blockSize != cacheSize\n");
     return false;
   }
-  if (policy.blockNum % policy.associativity != 0) {
+  if (policy.associativity == 0 ||
+      policy.blockNum % policy.associativity != 0) {
     fprintf(stderr, "blockNum %% associativity != 0\n");
     return false;
   }
+  // The set index is taken straight from address bits
+  if (!this->isPowerOfTwo(policy.blockNum / policy.associativity)) {
+    fprintf(stderr, "Invalid Set Num %d\n",
+            policy.blockNum / policy.associativity);
+    return false;
+  }
   return true;
 }
 
 void Cache::initCache() {
-  this->blocks = std::vector<Block>(policy.blockNum);
-  for (uint32_t i = 0; i < this->blocks.size(); ++i) {
-    Block &b = this->blocks[i];
-    b.valid = false;
-    b.modified = false;
-    b.size = policy.blockSize;
-    b.tag = 0;
-    b.id = i / policy.associativity;
-    b.lastReference = 0;
-    b.data = std::vector<uint8_t>(b.size);
+  uint32_t setNum = policy.blockNum / policy.associativity;
+  this->setStrideBits = 0;
+  while ((1u << this->setStrideBits) < policy.associativity)
+    this->setStrideBits++;
+  size_t lineNum = size_t(setNum) << this->setStrideBits;
+  this->tags.resize(lineNum);
+  this->states.resize(lineNum);
+  this->validCount = std::vector<uint32_t>(setNum, 0);
+  for (size_t i = 0; i < lineNum; ++i) this->tags[i] = INVALID_TAG;
+  this->replacement =
+      createReplacementPolicy(policy.replacement, policy.oracle);
+  this->replacement->init(setNum, policy.associativity, this->setStrideBits);
+  this->tagMatch = selectTagMatch(policy.associativity);
+  this->prefetcher =
+      createPrefetcher(policy.prefetcher, policy.prefetchTableSize,
+                       policy.prefetchDegree, policy.prefetchDistance,
+                       policy.blockSize);
+  this->streams = nullptr;
+  if (policy.prefetcher == PREFETCH_STREAM)
+    this->streams = new StreamBuffers(policy.prefetchTableSize,
+                                      policy.prefetchDegree, policy.blockSize,
+                                      !policy.tagOnly);
+  this->pollutionFilter =
+      std::vector<uint64_t>(POLLUTION_FILTER_BITS / 64, 0);
+  this->mshrs = std::vector<Mshr>(policy.mshrEntries, Mshr{0, 0});
+  this->writeBuffer = std::vector<WriteEntry>(
+      policy.writeBufferEntries, WriteEntry{0, 0, false, false});
+  this->writeBufferMask =
+      std::vector<uint8_t>(size_t(policy.writeBufferEntries) * policy.blockSize);
+  if (!policy.tagOnly)
+    this->writeBufferData = std::vector<uint8_t>(
+        size_t(policy.writeBufferEntries) * policy.blockSize);
+  this->inFlight.clear();
+  this->inFlightData.clear();
+  if (this->prefetcher != nullptr) {
+    this->inFlight = std::vector<InFlight>(
+        size_t(PREFETCH_QUEUE_SIZE), InFlight{0, 0, false});
+    if (!policy.tagOnly)
+      this->inFlightData = std::vector<uint8_t>(
+          size_t(PREFETCH_QUEUE_SIZE) * policy.blockSize);
+  }
+  this->bindEngine();
+  if (!policy.tagOnly) {
+    this->blockData = std::vector<uint8_t>(lineNum * policy.blockSize);
+    this->fillBuffer = std::vector<uint8_t>(policy.blockSize);
+  }
+  this->victimClock = 0;
+  if (policy.victimEntries > 0) {
+    this->victimAddrs = std::vector<uint32_t>(policy.victimEntries, 0);
+    this->victimStates = std::vector<uint8_t>(policy.victimEntries, 0);
+    // A single set, its stride only has to cover every entry
+    uint32_t strideBits = 0;
+    while ((1u << strideBits) < policy.victimEntries) strideBits++;
+    this->victimOrder.init(1, policy.victimEntries, strideBits);
+    if (!policy.tagOnly)
+      this->victimData =
+          std::vector<uint8_t>(size_t(policy.victimEntries) * policy.blockSize);
   }
 }
 
-void Cache::loadBlockFromLowerLevel(uint32_t addr, uint32_t *cycles) {
+uint32_t Cache::loadBlockFromLowerLevel(uint32_t addr, uint32_t *cycles,
+                                        bool allocate) {
+  // Fetch the new block first, the victim is only chosen and written back
+  // afterwards, so it goes through a buffer when data is kept
+  uint8_t *data = this->policy.tagOnly ? nullptr : this->fillBuffer.data();
+  // A demand fill stalls until the block arrives
+  this->fillDirty = false;
+  this->fillBlock = this->getBlockAddr(addr);
+  this->fillState = 0;
+  this->fillLost = false;
+  this->clock += this->fetchBlock(this->getBlockAddr(addr), data, cycles,
+                                  &this->fillDirty);
+  uint32_t line = NO_LINE;
+  if (allocate && !this->fillLost)
+    line = this->installBlock(
+        addr, data, this->fillDirty ? LINE_VALID | LINE_MODIFIED : LINE_VALID);
+  this->fillBlock = NO_LINE;
+  return line;
+}
+
+// Read the block at blockAddr from the level below into data, which is
+// nullptr when no data is kept, as a request arriving there now. Returns
+// the latency of the request. Given dirty, an exclusive level below hands
+// the block over and sets dirty if it was modified; prefetches pass none
+// and leave a copy there.
+uint64_t Cache::fetchBlock(uint32_t blockAddr, uint8_t *data,
+                           uint32_t *cycles, bool *dirty) {
   uint32_t blockSize = this->policy.blockSize;
+  if (!this->writeBuffer.empty()) this->flushWriteEntry(blockAddr);
+  if (this->lowerCache == nullptr) {
+    if (data != nullptr) {
+      for (uint32_t i = 0; i < blockSize; ++i)
+        data[i] = this->memory->getByteNoCache(blockAddr + i);
+    }
+    uint32_t latency =
+        this->policy.dram != nullptr
+            ? this->policy.dram->access(blockAddr, false, this->clock)
+            : MEMORY_LATENCY;
+    if (cycles) *cycles = latency;
+    return latency;
+  }
+  this->lowerCache->clock = this->clock;
+  if (dirty != nullptr &&
+      this->lowerCache->policy.inclusion == INCLUSION_EXCLUSIVE)
+    *dirty = this->lowerCache->takeBlock(blockAddr, data, cycles);
+  else
+    this->lowerCache->readBlock(blockAddr, blockSize, data, cycles, true);
+  return this->lowerCache->completion - this->clock;
+}
 
-  // Initialize new block from memory
-  Block b;
-  b.valid = true;
-  b.modified = false;
-  b.tag = this->getTag(addr);
-  b.id = this->getId(addr);
-  b.size = blockSize;
-  b.data = std::vector<uint8_t>(b.size);
-  uint32_t bits = this->log2i(blockSize);
-  uint32_t mask = ~((1 << bits) - 1);
-  uint32_t blockAddrBegin = addr & mask;
-  for (uint32_t i = blockAddrBegin; i < blockAddrBegin + blockSize; ++i) {
-    bool countStats = (i == blockAddrBegin);  
-    if (this->lowerCache == nullptr) {
-      b.data[i - blockAddrBegin] = this->memory->getByteNoCache(i);
-      if (cycles) *cycles = 100;
-    } else 
-      b.data[i - blockAddrBegin] = this->lowerCache->getByte(i, cycles, countStats);
-  }
-
-  // Find replace block
+// Put the block of addr into its set, evicting the victim of the set.
+// Returns NO_LINE when the block was back-invalidated while the victim
+// left, its data then in the fill buffer.
+uint32_t Cache::installBlock(uint32_t addr, const uint8_t *data,
+                             uint8_t state) {
   uint32_t id = this->getId(addr);
-  uint32_t blockIdBegin = id * this->policy.associativity;
-  uint32_t blockIdEnd = (id + 1) * this->policy.associativity;
-  uint32_t replaceId = this->getReplacementBlockId(blockIdBegin, blockIdEnd);
-  Block replaceBlock = this->blocks[replaceId];
-  
-  if(tech == FIFO) FIFO_id.push(replaceId);
+  uint32_t replaceId = this->getReplacementBlockId(id);
 
-  if (replaceBlock.valid && replaceBlock.modified) {
-    this->writeBlockToLowerLevel(replaceBlock);
-    this->statistics.totalCycles += this->policy.missLatency;
+  uint8_t replaced = this->states[replaceId];
+  uint32_t wasFilling = this->fillBlock;
+  this->fillBlock = this->getBlockAddr(addr);
+  this->fillState = state;
+  this->fillData = data;
+  this->fillLost = false;
+  if (replaced & LINE_VALID) {
+    if (this->prefetcher != nullptr)
+      this->prefetcher->evicted(this->getAddr(replaceId));
+    if (state & LINE_PREFETCHED) this->markPolluted(this->getAddr(replaceId));
+    if (this->policy.victimEntries > 0) {
+      this->moveToVictimBuffer(replaceId);
+    } else {
+      if (replaced & LINE_MODIFIED)
+        this->statistics.totalCycles += this->policy.missLatency;
+      this->evictBlock(
+          this->getAddr(replaceId),
+          this->policy.tagOnly ? nullptr : this->getLineData(replaceId),
+          replaced);
+    }
   }
 
-  this->blocks[replaceId] = b;
+  this->fillBlock = wasFilling;
+  this->fillState = 0;
+
+  if (this->fillLost) {
+    // The victim is gone too, unless it was back-invalidated while leaving
+    if (this->states[replaceId] & LINE_VALID) {
+      this->validCount[id]--;
+      this->states[replaceId] = 0;
+      this->tags[replaceId] = INVALID_TAG;
+      this->replacement->invalidate(replaceId);
+    }
+    if (data != nullptr && data != this->fillBuffer.data())
+      memcpy(this->fillBuffer.data(), data, this->policy.blockSize);
+    this->fillDirty = false;
+    return NO_LINE;
+  }
+  // Counted unless the line still holds the victim
+  if (!(this->states[replaceId] & LINE_VALID)) this->validCount[id]++;
+  this->tags[replaceId] = this->getTag(addr);
+  this->states[replaceId] = state;
+  this->replacement->insert(replaceId, this->getBlockAddr(addr),
+                            this->referenceCounter);
+  if (data != nullptr)
+    memcpy(this->getLineData(replaceId), data, this->policy.blockSize);
+  // Buffered copies would go stale once the line is written
+  if (this->streams != nullptr)
+    this->streams->invalidate(this->getBlockAddr(addr));
+  return replaceId;
 }
 
-uint32_t Cache::getReplacementBlockId(uint32_t begin, uint32_t end) {
+uint32_t Cache::victimRuntime(uint32_t id) {
+  uint32_t begin = id << this->setStrideBits;
+  uint32_t end = begin + this->policy.associativity;
   // Find invalid block first
-  for (uint32_t i = begin; i < end; ++i) {
-    if (!this->blocks[i].valid)
+  if (this->validCount[id] < this->policy.associativity) {
+    for (uint32_t i = begin; i < end; ++i) {
+      if (!(this->states[i] & LINE_VALID))
+        return i;
+    }
+  }
+  return this->replacement->victim(id);
+}
+
+int32_t Cache::findVictimEntry(uint32_t addr) {
+  uint32_t blockAddr = this->getBlockAddr(addr);
+  for (uint32_t i = 0; i < this->policy.victimEntries; ++i) {
+    if ((this->victimStates[i] & LINE_VALID) &&
+        this->victimAddrs[i] == blockAddr)
       return i;
   }
+  return -1;
+}
+
+// Victim buffer hit: the block moves back into its set and the line it
+// replaces takes its place in the buffer
+uint32_t Cache::swapFromVictimBuffer(uint32_t addr, uint32_t entry) {
+  uint32_t blockSize = this->policy.blockSize;
+  uint32_t id = this->getId(addr);
+  uint32_t replaceId = this->getReplacementBlockId(id);
+  uint8_t state = this->victimStates[entry];
+  uint8_t *entryData = this->policy.tagOnly
+                           ? nullptr
+                           : &this->victimData[size_t(entry) * blockSize];
 
-  if (tech == FIFO)
-  {
-    uint32_t id = FIFO_id.front();
-    FIFO_id.pop();
-    return id;
+  if (!(this->states[replaceId] & LINE_VALID)) {
+    this->validCount[id]++;
+    this->victimStates[entry] = 0;
+    this->victimOrder.invalidate(entry);
+    if (entryData != nullptr)
+      memcpy(this->getLineData(replaceId), entryData, blockSize);
+  } else {
+    uint32_t evicted = this->getAddr(replaceId);
+    this->victimAddrs[entry] = evicted;
+    this->victimStates[entry] = this->states[replaceId];
+    this->victimOrder.insert(entry, evicted, ++this->victimClock);
+    if (entryData != nullptr)
+      std::swap_ranges(entryData, entryData + blockSize,
+                       this->getLineData(replaceId));
+  }
+
+  this->tags[replaceId] = this->getTag(addr);
+  this->states[replaceId] = state;
+  this->replacement->insert(replaceId, this->getBlockAddr(addr),
+                            this->referenceCounter);
+  return replaceId;
+}
+
+// Evicted line enters the buffer, pushing out its least recently inserted
+// entry, which leaves the level
+void Cache::moveToVictimBuffer(uint32_t line) {
+  uint32_t blockSize = this->policy.blockSize;
+  uint32_t entry = this->victimOrder.victim(0);
+  uint8_t *entryData = this->policy.tagOnly
+                           ? nullptr
+                           : &this->victimData[size_t(entry) * blockSize];
+  if (this->victimStates[entry] & LINE_VALID) {
+    if (this->victimStates[entry] & LINE_MODIFIED)
+      this->statistics.totalCycles += this->policy.missLatency;
+    this->evictBlock(this->victimAddrs[entry], entryData,
+                     this->victimStates[entry]);
   }
 
-  // Otherwise use LRU
-  uint32_t resultId = begin;
-  uint32_t min = this->blocks[begin].lastReference;
-  for (uint32_t i = begin; i < end; ++i) {
-    if (this->blocks[i].lastReference < min) {
-      resultId = i;
-      min = this->blocks[i].lastReference;
+  this->victimAddrs[entry] = this->getAddr(line);
+  this->victimStates[entry] = this->states[line];
+  this->victimOrder.insert(entry, this->victimAddrs[entry], ++this->victimClock);
+  if (entryData != nullptr)
+    memcpy(entryData, this->getLineData(line), blockSize);
+}
+
+// The block at addr leaves this level. An inclusive level first drops the
+// copies above, their modified data being newer than its own.
+void Cache::evictBlock(uint32_t addr, uint8_t *data, uint8_t state) {
+  if (this->policy.inclusion == INCLUSION_INCLUSIVE) {
+    for (Cache *upper : this->upperCaches) {
+      bool dirty = false;
+      if (upper->invalidateBlock(addr, data, &dirty))
+        this->statistics.numBackInvalidation++;
+      if (dirty) state |= LINE_MODIFIED;
     }
   }
-  return resultId;
+  bool exclusiveBelow =
+      this->lowerCache != nullptr &&
+      this->lowerCache->policy.inclusion == INCLUSION_EXCLUSIVE;
+  // Older stores to the block still buffered must not land after it. The
+  // block already holds them, so they are dropped and it leaves dirty;
+  // sending them could make the levels below evict a block being filled.
+  if ((exclusiveBelow || (state & LINE_MODIFIED)) &&
+      this->mergeWriteEntry(this->getBlockAddr(addr), nullptr))
+    state |= LINE_MODIFIED;
+  if (exclusiveBelow)
+    this->lowerCache->insertBlock(addr, data, state & LINE_MODIFIED);
+  else if (state & LINE_MODIFIED)
+    this->writeBlockToLowerLevel(addr, data);
 }
 
-void Cache::writeBlockToLowerLevel(Cache::Block &b) {
-  uint32_t addrBegin = getAddr(const_cast<Block&>(b));
-  uint32_t tmpC;
-  for (uint32_t i = 0; i < b.size; ++i) {
-    uint32_t a = addrBegin + i;
-    if (lowerCache) {
-      lowerCache->setByte(a, b.data[i], &tmpC, false);
-    } else {
-      memory->setByteNoCache(a, b.data[i]);
+// Back-invalidation: drop every copy of the block here and above. Modified
+// data is copied to data and sets dirty. Returns whether any copy existed.
+bool Cache::invalidateBlock(uint32_t addr, uint8_t *data, bool *dirty) {
+  uint32_t blockSize = this->policy.blockSize;
+  uint32_t blockAddr = this->getBlockAddr(addr);
+  // Stores still buffered for the block are older than any copy here or
+  // above and would reach the level below after the block
+  bool held = this->mergeWriteEntry(blockAddr, data);
+  if (held) *dirty = true;
+  int32_t line = this->getBlockId(addr);
+  if (line != -1) {
+    held = true;
+    if (this->states[line] & LINE_MODIFIED) {
+      *dirty = true;
+      if (data != nullptr && !this->policy.tagOnly)
+        memcpy(data, this->getLineData(line), blockSize);
     }
+    this->invalidateLine(line);
+  }
+  int32_t entry = this->findVictimEntry(addr);
+  if (entry != -1) {
+    held = true;
+    if (this->victimStates[entry] & LINE_MODIFIED) {
+      *dirty = true;
+      if (data != nullptr && !this->policy.tagOnly)
+        memcpy(data, &this->victimData[size_t(entry) * blockSize], blockSize);
+    }
+    this->victimStates[entry] = 0;
+    this->victimOrder.invalidate(entry);
+  }
+  int32_t request = this->findInFlight(blockAddr);
+  if (request != -1) {
+    held = true;
+    this->inFlight[request].valid = false;
+  }
+  if (this->streams != nullptr && this->streams->contains(blockAddr)) {
+    held = true;
+    this->streams->invalidate(blockAddr);
+  }
+  if (this->fillBlock == blockAddr) {
+    held = true;
+    this->fillLost = true;
+    if (this->fillState & LINE_MODIFIED) {
+      *dirty = true;
+      if (data != nullptr && this->fillData != nullptr)
+        memcpy(data, this->fillData, blockSize);
+    }
+  }
+  // Copies above are newer than this one
+  for (Cache *upper : this->upperCaches) {
+    if (upper->invalidateBlock(addr, data, dirty)) held = true;
+  }
+  return held;
+}
+
+void Cache::invalidateLine(uint32_t line) {
+  if (this->prefetcher != nullptr)
+    this->prefetcher->evicted(this->getAddr(line));
+  this->validCount[line >> this->setStrideBits]--;
+  this->states[line] = 0;
+  this->tags[line] = INVALID_TAG;
+  this->replacement->invalidate(line);
+}
+
+void Cache::writeBlockToLowerLevel(uint32_t addrBegin, const uint8_t *data) {
+  uint32_t blockSize = this->policy.blockSize;
+  if (lowerCache) {
+    lowerCache->writeBlock(addrBegin, blockSize, data);
+  } else {
+    if (data != nullptr) {
+      for (uint32_t i = 0; i < blockSize; ++i)
+        memory->setByteNoCache(addrBegin + i, data[i]);
+    }
+    // Written back in the background, but it moves the row buffers
+    if (this->policy.dram != nullptr)
+      this->policy.dram->access(addrBegin, true, this->clock);
   }
 }
 
@@ -353,30 +1284,12 @@ uint32_t Cache::log2i(uint32_t val) {
   return ret;
 }
 
-uint32_t Cache::getTag(uint32_t addr) {
-  uint32_t offsetBits = log2i(policy.blockSize);
-  uint32_t idBits = log2i(policy.blockNum / policy.associativity);
-  uint32_t mask = (1 << (32 - offsetBits - idBits)) - 1;
-  return (addr >> (offsetBits + idBits)) & mask;
-}
-
-uint32_t Cache::getId(uint32_t addr) {
-  uint32_t offsetBits = log2i(policy.blockSize);
-  uint32_t idBits = log2i(policy.blockNum / policy.associativity);
-  uint32_t mask = (1 << idBits) - 1;
-  return (addr >> offsetBits) & mask;
-}
-
-uint32_t Cache::getOffset(uint32_t addr) {
-  uint32_t bits = log2i(policy.blockSize);
-  uint32_t mask = (1 << bits) - 1;
-  return addr & mask;
-}
-
-uint32_t Cache::getAddr(Cache::Block &b) {
-  uint32_t offsetBits = log2i(policy.blockSize);
-  uint32_t idBits = log2i(policy.blockNum / policy.associativity);
-  return (b.tag << (offsetBits + idBits)) | (b.id << offsetBits);
+void Cache::initAddressBits() {
+  policy.offsetBits = log2i(policy.blockSize);
+  policy.indexBits = log2i(policy.blockNum / policy.associativity);
+  policy.tagShift = policy.offsetBits + policy.indexBits;
+  policy.offsetMask = policy.blockSize - 1;
+  policy.indexMask = (1u << policy.indexBits) - 1;
 }
 
 uint8_t Cache::read(uint32_t addr) {
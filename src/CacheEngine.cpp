@@ -0,0 +1,132 @@
+/*
+ * Set lookup and victim selection specialised on cache geometry.
+ *
+ * Cache is configured at runtime, so its generic lookup pays for dynamic
+ * shifts, masks and loop bounds on every access. The templates below fix
+ * block size, set count and associativity at compile time, letting the
+ * compiler unroll the set search, and bindEngine() picks them for the
+ * geometries we simulate most. Anything else keeps the runtime engine.
+ */
+
+#include "Cache.h"
+
+namespace {
+
+constexpr uint32_t ilog2(uint32_t v) { return v <= 1 ? 0 : 1 + ilog2(v >> 1); }
+
+// Same rounding as Cache::initCache()
+constexpr uint32_t strideBits(uint32_t ways) {
+  return (1u << ilog2(ways)) < ways ? ilog2(ways) + 1 : ilog2(ways);
+}
+
+} // namespace
+
+template <uint32_t BlockSize, uint32_t SetNum, uint32_t Ways>
+uint32_t Cache::lookupFixed(uint32_t addr) {
+  const uint32_t offsetBits = ilog2(BlockSize);
+  const uint32_t tagShift = offsetBits + ilog2(SetNum);
+  uint32_t tag = addr >> tagShift;
+  uint32_t begin = ((addr >> offsetBits) & (SetNum - 1)) << strideBits(Ways);
+  const uint32_t *setTags = &this->tags[begin];
+  const uint8_t *setStates = &this->states[begin];
+
+  if (Ways > 32) {
+    // Too wide to unroll, use the vectorised search with a constant width
+    int32_t i = this->tagMatch(setTags, Ways, tag);
+    if (i >= 0 && (setStates[i] & LINE_VALID)) return begin + i;
+    return i < 0 ? uint32_t(-1) : this->lookupRuntime(addr);
+  }
+
+  // Branch-free compare of the whole set, the compiler unrolls this
+  uint32_t mask = 0;
+  for (uint32_t i = 0; i < Ways; ++i)
+    mask |= uint32_t(setTags[i] == tag && (setStates[i] & LINE_VALID)) << i;
+  return mask ? begin + __builtin_ctz(mask) : uint32_t(-1);
+}
+
+template <uint32_t Ways, class Repl>
+uint32_t Cache::victimFixed(uint32_t id) {
+  uint32_t begin = id << strideBits(Ways);
+  if (this->validCount[id] < Ways) {
+    const uint8_t *setStates = &this->states[begin];
+    for (uint32_t i = 0; i < Ways; ++i) {
+      if (!(setStates[i] & LINE_VALID)) return begin + i;
+    }
+  }
+  // Qualified call, so the policy's victim() is inlined rather than virtual
+  return static_cast<Repl *>(this->replacement)->Repl::victim(id);
+}
+
+template <uint32_t Ways>
+Cache::VictimFunc Cache::selectVictimFixed(ReplacementKind kind) {
+  switch (kind) {
+  case REPLACE_LRU:
+    return &Cache::victimFixed<Ways, LruReplacement>;
+  case REPLACE_FIFO:
+    return &Cache::victimFixed<Ways, FifoReplacement>;
+  case REPLACE_PLRU:
+    return &Cache::victimFixed<Ways, PlruReplacement>;
+  case REPLACE_NRU:
+    return &Cache::victimFixed<Ways, NruReplacement>;
+  case REPLACE_RANDOM:
+    return &Cache::victimFixed<Ways, RandomReplacement>;
+  case REPLACE_SRRIP:
+  case REPLACE_BRRIP:
+  case REPLACE_DRRIP:
+    return &Cache::victimFixed<Ways, RripReplacement>;
+  case REPLACE_OPT:
+    return &Cache::victimFixed<Ways, OptReplacement>;
+  }
+  return &Cache::victimRuntime;
+}
+
+namespace {
+
+struct GeometryEntry {
+  uint32_t blockSize;
+  uint32_t setNum;
+  uint32_t ways;
+  uint32_t (Cache::*lookup)(uint32_t);
+};
+
+} // namespace
+
+void Cache::bindEngine() {
+  // MultiLevelCacheConfig L1/L2/L3, its fully associative FIFO L1, and the
+  // unified and split direct-mapped caches of createSingleLevelPolicy()
+  static const GeometryEntry geometries[] = {
+      {64, 256, 1, &Cache::lookupFixed<64, 256, 1>},
+      {64, 128, 1, &Cache::lookupFixed<64, 128, 1>},
+      {64, 256, 8, &Cache::lookupFixed<64, 256, 8>},
+      {64, 2048, 16, &Cache::lookupFixed<64, 2048, 16>},
+      {64, 1, 256, &Cache::lookupFixed<64, 1, 256>},
+  };
+
+  uint32_t setNum = this->policy.blockNum / this->policy.associativity;
+  this->lookupFunc = &Cache::lookupRuntime;
+  this->victimFunc = &Cache::victimRuntime;
+  this->fixedEngine = false;
+  for (const GeometryEntry &g : geometries) {
+    if (g.blockSize == this->policy.blockSize && g.setNum == setNum &&
+        g.ways == this->policy.associativity) {
+      this->lookupFunc = g.lookup;
+      this->fixedEngine = true;
+      break;
+    }
+  }
+  ReplacementKind kind = this->policy.replacement;
+  switch (this->policy.associativity) {
+  case 1:
+    this->victimFunc = selectVictimFixed<1>(kind);
+    break;
+  case 8:
+    this->victimFunc = selectVictimFixed<8>(kind);
+    break;
+  case 16:
+    this->victimFunc = selectVictimFixed<16>(kind);
+    break;
+  case 256:
+    this->victimFunc = selectVictimFixed<256>(kind);
+    break;
+  }
+}
@@ -0,0 +1,161 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "Dram.h"
+
+static const char *pagePolicyNames[] = {"open", "closed"};
+static const char *mappingNames[] = {"row", "line", "xor"};
+
+const char *dramPagePolicyName(DramPagePolicy policy) {
+  return pagePolicyNames[policy];
+}
+
+bool parseDramPagePolicy(const char *name, DramPagePolicy *policy) {
+  for (uint32_t i = 0; i < sizeof(pagePolicyNames) / sizeof(char *); ++i) {
+    if (strcmp(name, pagePolicyNames[i]) == 0) {
+      *policy = DramPagePolicy(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *dramMappingName(DramMapping mapping) {
+  return mappingNames[mapping];
+}
+
+bool parseDramMapping(const char *name, DramMapping *mapping) {
+  for (uint32_t i = 0; i < sizeof(mappingNames) / sizeof(char *); ++i) {
+    if (strcmp(name, mappingNames[i]) == 0) {
+      *mapping = DramMapping(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool isPowerOfTwo(uint32_t n) { return n > 0 && (n & (n - 1)) == 0; }
+
+static uint32_t log2i(uint32_t val) {
+  uint32_t ret = 0;
+  while (val > 1) {
+    val >>= 1;
+    ret++;
+  }
+  return ret;
+}
+
+Dram::Dram(const DramConfig &config) {
+  this->config = config;
+  if (!isPowerOfTwo(config.channels) || !isPowerOfTwo(config.ranks) ||
+      !isPowerOfTwo(config.banks) || !isPowerOfTwo(config.blockSize) ||
+      !isPowerOfTwo(config.rowSize) || config.rowSize < config.blockSize) {
+    fprintf(stderr, "DRAM config invalid!\n");
+    exit(-1);
+  }
+  this->offsetBits = log2i(config.blockSize);
+  this->columnBits = log2i(config.rowSize / config.blockSize);
+  this->channelBits = log2i(config.channels);
+  this->bankBits = log2i(config.banks);
+  this->rankBits = log2i(config.ranks);
+  this->banks = std::vector<Bank>(config.channels * config.ranks * config.banks,
+                                  Bank{0, false, 0});
+  this->busFree = std::vector<uint64_t>(config.channels, 0);
+  memset(&this->statistics, 0, sizeof(this->statistics));
+}
+
+void Dram::map(uint32_t addr, uint32_t *bank, uint32_t *channel,
+               uint32_t *row) {
+  uint32_t block = addr >> this->offsetBits;
+  uint32_t channelMask = this->config.channels - 1;
+  uint32_t bankMask = this->config.banks - 1;
+  uint32_t rankMask = this->config.ranks - 1;
+  uint32_t rank, bankInRank;
+  if (this->config.mapping == DRAM_MAP_LINE) {
+    *channel = block & channelMask;
+    block >>= this->channelBits;
+    bankInRank = block & bankMask;
+    block >>= this->bankBits;
+    rank = block & rankMask;
+    block >>= this->rankBits + this->columnBits;
+    *row = block;
+  } else {
+    block >>= this->columnBits;
+    *channel = block & channelMask;
+    block >>= this->channelBits;
+    bankInRank = block & bankMask;
+    block >>= this->bankBits;
+    rank = block & rankMask;
+    block >>= this->rankBits;
+    *row = block;
+    if (this->config.mapping == DRAM_MAP_XOR) bankInRank ^= *row & bankMask;
+  }
+  *bank = (*channel * this->config.ranks + rank) * this->config.banks +
+          bankInRank;
+}
+
+uint32_t Dram::access(uint32_t addr, bool isWrite, uint64_t now) {
+  uint32_t index, channel, row;
+  this->map(addr, &index, &channel, &row);
+  Bank &bank = this->banks[index];
+
+  uint64_t start = bank.ready > now ? bank.ready : now;
+  uint32_t service = this->config.tCAS;
+  if (bank.open && bank.openRow == row) {
+    this->statistics.numRowHit++;
+  } else if (!bank.open) {
+    this->statistics.numRowEmpty++;
+    service += this->config.tRCD;
+  } else {
+    this->statistics.numRowConflict++;
+    service += this->config.tRP + this->config.tRCD;
+  }
+  uint64_t dataAt = start + service;
+  if (dataAt < this->busFree[channel]) dataAt = this->busFree[channel];
+  this->busFree[channel] = dataAt + this->config.tBurst;
+
+  if (this->config.pagePolicy == PAGE_CLOSED) {
+    bank.open = false;
+    bank.ready = dataAt + this->config.tBurst + this->config.tRP;
+  } else {
+    bank.open = true;
+    bank.openRow = row;
+    bank.ready = dataAt;
+  }
+
+  uint32_t latency = uint32_t(dataAt + this->config.tBurst - now);
+  if (isWrite)
+    this->statistics.numWrite++;
+  else
+    this->statistics.numRead++;
+  this->statistics.totalCycles += latency;
+  return latency;
+}
+
+void Dram::printInfo() {
+  printf("---------- DRAM Info -----------\n");
+  printf("Channels: %d, Ranks: %d, Banks: %d\n", this->config.channels,
+         this->config.ranks, this->config.banks);
+  printf("Row Size: %d bytes\n", this->config.rowSize);
+  printf("tRCD %d, tCAS %d, tRP %d, tBurst %d\n", this->config.tRCD,
+         this->config.tCAS, this->config.tRP, this->config.tBurst);
+  printf("Page Policy: %s\n", dramPagePolicyName(this->config.pagePolicy));
+  printf("Mapping: %s\n", dramMappingName(this->config.mapping));
+}
+
+void Dram::printStatistics() {
+  const Statistics &stats = this->statistics;
+  uint32_t total = stats.numRead + stats.numWrite;
+  printf("-------- DRAM STATISTICS ----------\n");
+  printf("Num Read: %d\n", stats.numRead);
+  printf("Num Write: %d\n", stats.numWrite);
+  printf("Row Hit: %d\n", stats.numRowHit);
+  printf("Row Empty: %d\n", stats.numRowEmpty);
+  printf("Row Conflict: %d\n", stats.numRowConflict);
+  printf("Row Hit Rate: %.2f%%\n",
+         total > 0 ? stats.numRowHit * 100.0f / total : 0.0f);
+  printf("Total Cycles: %lu\n", stats.totalCycles);
+  printf("Average Latency: %.2f\n",
+         total > 0 ? float(stats.totalCycles) / total : 0.0f);
+}
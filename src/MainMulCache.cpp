@@ -1,5 +1,6 @@
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -9,16 +10,38 @@
 #include "Debug.h"
 #include "MemoryManager.h"
 #include "MultiLevelCacheConfig.h"
-
-#define PREFETCHING 1
-#define FIFO 2
-#define VICTIM 3
+#include "TraceReader.h"
 
 bool parseParameters(int argc, char **argv);
+bool parseLevelCounts(const char *p, uint32_t counts[3], uint32_t fallback);
 void printUsage();
 
 int tech = 0;
+uint32_t victimEntries = 0;  // L1 victim buffer size given with -v<N>
+// L1 stride prefetcher given with -p<degree>[,<distance>], 0 for defaults
+uint32_t prefetchDegree = 0, prefetchDistance = 0;
+// Prefetcher of L1, L2 and L3 given with -P/-P1, -P2 and -P3. An L1 left
+// at none uses the stride prefetcher under -p.
+PrefetcherKind levelPrefetcher[3] = {PREFETCH_NONE, PREFETCH_NONE,
+                                     PREFETCH_NONE};
+// MSHRs of L1, L2 and L3 given with -m, 0 for the serial timing model
+uint32_t levelMshrs[3] = {0, 0, 0};
+// Inclusion policy of L2 and L3 towards the levels above
+InclusionPolicy levelInclusion[2] = {INCLUSION_NINE, INCLUSION_NINE};
+// Write policies of L1, L2 and L3 given with -w, and their write buffer
+// entries given with -b
+WritePolicy levelWritePolicy[3] = {WRITE_BACK, WRITE_BACK, WRITE_BACK};
+WriteMissPolicy levelWriteMiss[3] = {WRITE_ALLOCATE, WRITE_ALLOCATE,
+                                     WRITE_ALLOCATE};
+uint32_t levelWriteBuffers[3] = {0, 0, 0};
+// DRAM behind L3 given with -d, flat memory latency otherwise
+bool useDram = false;
+DramConfig dramConfig = MultiLevelCacheConfig::getDramConfig();
 const char *traceFilePath;
+// CSV results, next to the trace unless given with -o
+const char *outputPath;
+// Replacement policy of L1, L2 and L3
+ReplacementKind levelReplacement[3] = {REPLACE_LRU, REPLACE_LRU, REPLACE_LRU};
 
 class CacheHierarchy {
 private:
@@ -26,6 +49,10 @@ private:
   Cache* l1cache;
   Cache* l2cache;
   Cache* l3cache;
+  Dram* dram = nullptr;
+  // Trace lookahead of the OPT levels, one per block size
+  std::vector<TraceOracle*> oracles;
+  uint64_t position = 0;
 
 public:
   CacheHierarchy() {
@@ -34,7 +61,40 @@ public:
     auto l1policy = MultiLevelCacheConfig::getL1Policy();
     auto l2policy = MultiLevelCacheConfig::getL2Policy();
     auto l3policy = MultiLevelCacheConfig::getL3Policy();
-    if (tech == FIFO) l1policy.associativity = l1policy.blockNum;
+    l1policy.replacement = levelReplacement[0];
+    l2policy.replacement = levelReplacement[1];
+    l3policy.replacement = levelReplacement[2];
+    if (tech == FIFO) {
+      l1policy.associativity = l1policy.blockNum;
+      l1policy.replacement = REPLACE_FIFO;
+    }
+    if (tech == VICTIM) l1policy.victimEntries = victimEntries;
+    l1policy.prefetcher = levelPrefetcher[0];
+    l2policy.prefetcher = levelPrefetcher[1];
+    l3policy.prefetcher = levelPrefetcher[2];
+    l1policy.prefetchDegree = prefetchDegree;
+    l1policy.prefetchDistance = prefetchDistance;
+    l1policy.mshrEntries = levelMshrs[0];
+    l2policy.mshrEntries = levelMshrs[1];
+    l3policy.mshrEntries = levelMshrs[2];
+    l2policy.inclusion = levelInclusion[0];
+    l3policy.inclusion = levelInclusion[1];
+    Cache::Policy *policies[3] = {&l1policy, &l2policy, &l3policy};
+    for (int i = 0; i < 3; ++i) {
+      policies[i]->writePolicy = levelWritePolicy[i];
+      policies[i]->writeMiss = levelWriteMiss[i];
+      policies[i]->writeBufferEntries = levelWriteBuffers[i];
+    }
+    if (useDram) {
+      dramConfig.blockSize = l3policy.blockSize;
+      dram = new Dram(dramConfig);
+      l3policy.dram = dram;
+      // The DRAM model replaces the memory latency L3 misses paid
+      l3policy.missLatency = l3policy.hitLatency;
+    }
+    attachOracle(l1policy);
+    attachOracle(l2policy);
+    attachOracle(l3policy);
     l3cache = new Cache(memory, l3policy, nullptr, 0);
     l2cache = new Cache(memory, l2policy, l3cache, 0);
     l1cache = new Cache(memory, l1policy, l2cache, tech);
@@ -46,20 +106,26 @@ public:
     delete l1cache;
     delete l2cache;
     delete l3cache;
+    delete dram;
     delete memory;
+    for (TraceOracle *oracle : oracles) delete oracle;
   }
   
-  void processMemoryAccess(char op, uint32_t addr) {
+  void processMemoryAccess(char op, uint32_t addr, uint32_t pc) {
+    for (TraceOracle *oracle : oracles) oracle->setPosition(position);
+    position++;
+
     if (!memory->isPageExist(addr)) {
       memory->addPage(addr);
     }
     
+    uint32_t cycles;
     switch (op) {
       case 'r':
-        l1cache->read(addr);
+        l1cache->getByte(addr, &cycles, true, pc);
         break;
       case 'w':
-        l1cache->write(addr, 0);
+        l1cache->setByte(addr, 0, &cycles, true, pc);
         break;
       default:
         throw std::runtime_error("Illegal memory access operation");
@@ -75,8 +141,10 @@ public:
 
     printResults();
     
-    std::string csvPath = std::string(traceFilePath) + "_multi_level.csv";
+    std::string csvPath = outputPath ? outputPath
+                                     : std::string(traceFilePath) + "_multi_level.csv";
     std::ofstream csvFile(csvPath);
+    if (!csvFile) throw std::runtime_error("Unable to open file " + csvPath);
     
     csvFile << "Level,NumReads,NumWrites,NumHits,NumMisses,MissRate,TotalCycles\n";
 
@@ -84,11 +152,85 @@ public:
     outputCacheStats(csvFile, "L1", l1cache);
     outputCacheStats(csvFile, "L2", l2cache);
     outputCacheStats(csvFile, "L3", l3cache);
+    if (tech == VICTIM) outputVictimStats(csvFile, "L1 Victim", l1cache);
+    if (dram) outputDramStats(csvFile, "DRAM", dram);
+    if (levelMshrs[0] > 0) outputElapsed(csvFile, "Elapsed", l1cache);
 
     csvFile.close();
     printf("\nResults have been written to %s\n", csvPath.c_str());
   }
 private:
+  // Belady's OPT needs a pre-pass over the whole trace before simulation
+  void attachOracle(Cache::Policy &policy) {
+    if (policy.replacement != REPLACE_OPT) return;
+    for (TraceOracle *oracle : oracles) {
+      if (oracle->getBlockSize() == policy.blockSize) {
+        policy.oracle = oracle;
+        return;
+      }
+    }
+    TraceReader trace;
+    if (!trace.open(traceFilePath)) {
+      throw std::runtime_error("Unable to read trace for OPT pre-pass");
+    }
+    trace.setQuiet(true);
+    TraceOracle *oracle = new TraceOracle(policy.blockSize);
+    std::vector<TraceRecord> batch(TRACE_BATCH);
+    size_t count;
+    while ((count = trace.next(batch.data(), batch.size())) > 0) {
+      for (size_t i = 0; i < count; ++i) oracle->addAccess(batch[i].addr);
+    }
+    oracle->finish();
+    oracles.push_back(oracle);
+    policy.oracle = oracle;
+  }
+
+  // Probes of the victim buffer in the columns of a cache level
+  void outputVictimStats(std::ofstream& csvFile, const char* level, const Cache* cache) const {
+    auto& stats = cache->statistics;
+    uint32_t probes = stats.numVictimHit + stats.numVictimMiss;
+    float missRate = probes > 0 ? static_cast<float>(stats.numVictimMiss) / probes * 100 : 0;
+
+    csvFile << level << ","
+            << probes << ","
+            << 0 << ","
+            << stats.numVictimHit << ","
+            << stats.numVictimMiss << ","
+            << missRate << ","
+            << stats.victimCycles << "\n";
+  }
+
+  // Row buffer hits count as hits, row empty and conflicts as misses
+  void outputDramStats(std::ofstream& csvFile, const char* level, const Dram* dram) const {
+    auto& stats = dram->statistics;
+    uint32_t requests = stats.numRead + stats.numWrite;
+    uint32_t rowMisses = stats.numRowEmpty + stats.numRowConflict;
+    float missRate = requests > 0 ? static_cast<float>(rowMisses) / requests * 100 : 0;
+
+    csvFile << level << ","
+            << stats.numRead << ","
+            << stats.numWrite << ","
+            << stats.numRowHit << ","
+            << rowMisses << ","
+            << missRate << ","
+            << stats.totalCycles << "\n";
+  }
+
+  // Whole run as seen by the program, misses overlapping under MSHRs
+  void outputElapsed(std::ofstream& csvFile, const char* level, const Cache* cache) const {
+    auto& stats = cache->statistics;
+    float missRate = static_cast<float>(stats.numMiss) /
+                    (stats.numHit + stats.numMiss) * 100;
+
+    csvFile << level << ","
+            << stats.numRead << ","
+            << stats.numWrite << ","
+            << stats.numHit << ","
+            << stats.numMiss << ","
+            << missRate << ","
+            << stats.elapsedCycles << "\n";
+  }
+
   void outputCacheStats(std::ofstream& csvFile, const char* level, const Cache* cache) const {
     // modified
     if (!cache) {
@@ -115,20 +257,31 @@ int main(int argc, char **argv) {
     return -1;
   }
 
-  std::ifstream trace(traceFilePath);
-  if (!trace.is_open()) {
+  TraceReader trace;
+  if (!trace.open(traceFilePath)) {
     printf("Unable to open file %s\n", traceFilePath);
     return -1;
   }
+  // The OPT pre-pass reads the trace a second time
+  for (int i = 0; i < 3; ++i) {
+    if (levelReplacement[i] == REPLACE_OPT && trace.isStream()) {
+      printf("OPT replacement needs a trace file, not a pipe\n");
+      return -1;
+    }
+  }
 
   try {
     CacheHierarchy cacheHierarchy;
-    char op;
-    uint32_t addr;
-   // cacheHierarchy.l1cache->stride = 0; cacheHierarchy.l1cache->is_prefetch = false;
-    while (trace >> op >> std::hex >> addr) {
-      cacheHierarchy.processMemoryAccess(op, addr);
+    std::vector<TraceRecord> batch(TRACE_BATCH);
+    size_t count;
+    while ((count = trace.next(batch.data(), batch.size())) > 0) {
+      for (size_t i = 0; i < count; ++i) {
+        const TraceRecord &record = batch[i];
+        cacheHierarchy.processMemoryAccess(record.op, record.addr, record.pc);
+      }
     }
+    if (trace.getMalformedLines() > 0)
+      printf("Skipped %lu malformed trace lines\n", trace.getMalformedLines());
     
     cacheHierarchy.outputResults();
   } 
@@ -147,12 +300,144 @@ bool parseParameters(int argc, char **argv) {
       switch (argv[i][1]) {
       case 'p':
         tech = PREFETCHING;
+        if (argv[i][2] != '\0') {
+          char *end;
+          long n = strtol(argv[i] + 2, &end, 10);
+          if (n <= 0) return false;
+          prefetchDegree = n;
+          if (*end == ',') {
+            const char *distance = end + 1;
+            n = strtol(distance, &end, 10);
+            if (end == distance || n <= 0) return false;
+            prefetchDistance = n;
+          }
+          if (*end != '\0') return false;
+        }
         break;
       case 'f':
         tech = FIFO;
         break;
       case 'v':
+        // -v<N> sizes the buffer, plain -v uses the default
         tech = VICTIM;
+        if (argv[i][2] != '\0') {
+          char *end;
+          long n = strtol(argv[i] + 2, &end, 10);
+          if (*end != '\0' || n <= 0) return false;
+          victimEntries = n;
+        }
+        break;
+      case 'm':
+        // -m<N> gives every level N MSHRs, -m<N1>,<N2>,<N3> one count each
+        if (!parseLevelCounts(argv[i] + 2, levelMshrs,
+                              Cache::DEFAULT_MSHR_ENTRIES)) {
+          return false;
+        }
+        break;
+      case 'b':
+        // Write buffer entries, counted like -m
+        if (!parseLevelCounts(argv[i] + 2, levelWriteBuffers,
+                              Cache::DEFAULT_WRITE_BUFFER_ENTRIES)) {
+          return false;
+        }
+        break;
+      case 'w': {
+        // -w <hit>,<miss> sets every level, -w1/-w2/-w3 a single one; either
+        // policy may be left out
+        char level = argv[i][2];
+        int first = 0, last = 2;
+        if (level != '\0') {
+          if (level < '1' || level > '3' || argv[i][3] != '\0') return false;
+          first = last = level - '1';
+        }
+        if (i + 1 >= argc) return false;
+        const char *p = argv[++i];
+        for (;;) {
+          const char *end = strchr(p, ',');
+          std::string token = end ? std::string(p, end) : std::string(p);
+          WritePolicy write;
+          WriteMissPolicy miss;
+          if (parseWritePolicy(token.c_str(), &write)) {
+            for (int j = first; j <= last; ++j) levelWritePolicy[j] = write;
+          } else if (parseWriteMissPolicy(token.c_str(), &miss)) {
+            for (int j = first; j <= last; ++j) levelWriteMiss[j] = miss;
+          } else {
+            return false;
+          }
+          if (end == nullptr) break;
+          p = end + 1;
+        }
+        break;
+      }
+      case 'i': {
+        // -i <policy> sets L2 and L3, -i2/-i3 <policy> a single one
+        InclusionPolicy policy;
+        if (i + 1 >= argc || !parseInclusion(argv[i + 1], &policy)) {
+          return false;
+        }
+        char level = argv[i][2];
+        if (level == '\0') {
+          levelInclusion[0] = levelInclusion[1] = policy;
+        } else if ((level == '2' || level == '3') && argv[i][3] == '\0') {
+          levelInclusion[level - '2'] = policy;
+        } else {
+          return false;
+        }
+        ++i;
+        break;
+      }
+      case 'd': {
+        // -d<page>,<mapping> in any order, either may be left out
+        useDram = true;
+        const char *p = argv[i] + 2;
+        while (*p != '\0') {
+          const char *end = strchr(p, ',');
+          std::string token = end ? std::string(p, end) : std::string(p);
+          if (!parseDramPagePolicy(token.c_str(), &dramConfig.pagePolicy) &&
+              !parseDramMapping(token.c_str(), &dramConfig.mapping)) {
+            return false;
+          }
+          if (end == nullptr) break;
+          p = end + 1;
+          if (*p == '\0') return false;
+        }
+        break;
+      }
+      case 'P': {
+        char level = argv[i][2] == '\0' ? '1' : argv[i][2];
+        if (level < '1' || level > '3' ||
+            (argv[i][2] != '\0' && argv[i][3] != '\0') || i + 1 >= argc ||
+            !parsePrefetcher(argv[i + 1], &levelPrefetcher[level - '1'])) {
+          return false;
+        }
+        ++i;
+        break;
+      }
+      case 'r': {
+        // -r <policy> sets every level, -r1/-r2/-r3 <policy> a single one
+        ReplacementKind kind;
+        if (i + 1 >= argc || !parseReplacement(argv[i + 1], &kind)) {
+          return false;
+        }
+        char level = argv[i][2];
+        if (level == '\0') {
+          for (int j = 0; j < 3; ++j) levelReplacement[j] = kind;
+        } else if (level >= '1' && level <= '3' && argv[i][3] == '\0') {
+          levelReplacement[level - '1'] = kind;
+        } else {
+          return false;
+        }
+        ++i;
+        break;
+      }
+      case 'o':
+        if (argv[i][2] != '\0' || i + 1 == argc) return false;
+        outputPath = argv[++i];
+        break;
+      case '\0':
+        // "-" is the trace on stdin
+        if (traceFilePath != nullptr) return false;
+        traceFilePath = argv[i];
         break;
       default:
         return false;
@@ -168,7 +453,66 @@ bool parseParameters(int argc, char **argv) {
   if (traceFilePath == nullptr) {
     return false;
   }
+  if (outputPath == nullptr && strcmp(traceFilePath, "-") == 0) {
+    printf("Reading the trace from stdin needs -o\n");
+    return false;
+  }
   return true;
 }
 
-void printUsage() { printf("Usage: CacheSim trace-file\n"); }
+// Counts of -m and -b: <N> for every level, <N1>,<N2>,<N3> for each, or
+// nothing for fallback everywhere
+bool parseLevelCounts(const char *p, uint32_t counts[3], uint32_t fallback) {
+  uint32_t parsed[3] = {fallback, fallback, fallback};
+  int given = 0;
+  while (*p != '\0') {
+    char *end;
+    long n = strtol(p, &end, 10);
+    if (end == p || n <= 0 || given == 3) return false;
+    parsed[given++] = n;
+    if (*end == ',' && end[1] != '\0') ++end;
+    else if (*end != '\0') return false;
+    p = end;
+  }
+  if (given == 2) return false;
+  if (given == 1) parsed[1] = parsed[2] = parsed[0];
+  for (int j = 0; j < 3; ++j) counts[j] = parsed[j];
+  return true;
+}
+
+void printUsage() {
+  printf("Usage: CacheSim trace-file|- [-p[D[,S]]|-f|-v[N]] [-P[1-3] prefetcher] "
+         "[-r[1-3] policy] [-i[2-3] inclusion] [-w[1-3] write] "
+         "[-b[N[,N2,N3]]] [-m[N[,N2,N3]]] [-d[page][,mapping]] "
+         "[-o csv-file]\n");
+  printf("Parameters: -p per-PC stride prefetching of D blocks starting S "
+         "strides ahead (default %d,%d)\n",
+         StridePrefetcher::DEFAULT_DEGREE, StridePrefetcher::DEFAULT_DISTANCE);
+  printf("            -P/-P1, -P2, -P3 prefetcher of one level: none, stride, "
+         "next-line (tagged, D blocks on L1),\n");
+  printf("            stream (%d buffers of D blocks on L1), bop (best offset), "
+         "sms (spatial footprints)\n",
+         StreamBuffers::DEFAULT_COUNT);
+  printf("            -f fully associative FIFO L1, -v victim cache of N "
+         "entries behind L1 (default %d)\n",
+         Cache::DEFAULT_VICTIM_ENTRIES);
+  printf("            -r replacement of all levels, -r1/-r2/-r3 of one level: "
+         "lru, fifo, plru, nru, random,\n");
+  printf("            srrip, brrip, drrip, opt (Belady, trace pre-pass)\n");
+  printf("            -i inclusion of L2 and L3, -i2/-i3 of one level: nine, "
+         "inclusive, exclusive\n");
+  printf("            -w write policy of all levels, -w1/-w2/-w3 of one level: "
+         "back or through,\n");
+  printf("            allocate or no-allocate (default back,allocate)\n");
+  printf("            -b write-combining buffer of N entries per level for "
+         "stores sent down (default %d)\n",
+         Cache::DEFAULT_WRITE_BUFFER_ENTRIES);
+  printf("            -d DRAM behind L3 instead of a flat latency, page policy "
+         "open or closed,\n");
+  printf("            address mapping row, line or xor (default open,row)\n");
+  printf("            -m non-blocking timing with N MSHRs per level (default "
+         "%d), or one count per level\n",
+         Cache::DEFAULT_MSHR_ENTRIES);
+  printf("            -o results file (default trace-file_multi_level.csv), "
+         "- reads the trace from stdin\n");
+}
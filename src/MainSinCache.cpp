@@ -1,5 +1,6 @@
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -9,21 +10,34 @@
 #include "Cache.h"
 #include "Debug.h"
 #include "MemoryManager.h"
+#include "TraceReader.h"
 
 bool parseParameters(int argc, char **argv);
+bool parseSweep(const char *arg);
 void printUsage();
-void simulateCache(std::ofstream &csvFile, bool isSplit);
+
+struct CacheConfig {
+  uint32_t cacheSize;  // bytes, of both halves for the split cache
+  uint32_t blockSize;
+  uint32_t associativity;
+};
 
 bool verbose = false;
 bool isSingleStep = false;
 const char *traceFilePath;
+// CSV results, next to the trace unless given with -o
+const char *outputPath;
+// Unified caches given with -c, in place of the default unified and split
+// caches
+std::vector<CacheConfig> sweepConfigs;
 
 class ICache : public Cache {
 public:
   ICache(MemoryManager *manager, Policy policy, Cache *lowerCache = nullptr)
         : Cache(manager, policy, lowerCache) {}
 
-  void setByte(uint32_t addr, uint8_t val, uint32_t *cycles = nullptr, bool countStats = true) override {
+  void setByte(uint32_t addr, uint8_t val, uint32_t *cycles = nullptr, bool countStats = true,
+               uint32_t pc = 0) override {
     if (cycles) {
       *cycles = 0;
     }
@@ -36,20 +50,86 @@ public:
   virtual ~ICache() = default;
 };
 
+// One cache configuration driven by the shared pass over the trace
+struct Simulation {
+  CacheConfig config;
+  Cache *dCache;
+  ICache *iCache;  // split configuration only
+};
+
+Simulation createSimulation(MemoryManager *memory, const CacheConfig &config,
+                            bool isSplit);
+void simulateAccess(Simulation &sim, const TraceRecord &record);
+void finishSimulation(std::ofstream &csvFile, Simulation &sim);
+
 int main(int argc, char **argv) {
   if (!parseParameters(argc, argv)) {
+    printUsage();
+    return -1;
+  }
+
+  // Read and execute trace in cache-trace/ folder, text or binary, once
+  // for all configurations so that it may come from a pipe
+  TraceReader trace;
+  if (!trace.open(traceFilePath)) {
+    printf("Unable to open file %s\n", traceFilePath);
     return -1;
   }
 
   // Open CSV file and write header
-  std::ofstream csvFile(std::string(traceFilePath) + ".csv");
+  std::string csvPath =
+      outputPath ? outputPath : std::string(traceFilePath) + ".csv";
+  std::ofstream csvFile(csvPath);
+  if (!csvFile) {
+    printf("Unable to open file %s\n", csvPath.c_str());
+    return -1;
+  }
   csvFile << "cacheSize,blockSize,associativity,missRate,totalCycles\n";
 
-  simulateCache(csvFile, false); 
-  simulateCache(csvFile, true); 
+  // Tag-only caches keep no data, so all of them share the memory
+  MemoryManager *memory = new MemoryManager();
+  std::vector<Simulation> simulations;
+  if (sweepConfigs.empty()) {
+    CacheConfig config = {16 * 1024, 64, 1};
+    simulations.push_back(createSimulation(memory, config, false));
+    simulations.push_back(createSimulation(memory, config, true));
+  } else {
+    for (const CacheConfig &config : sweepConfigs)
+      simulations.push_back(createSimulation(memory, config, false));
+    printf("Sweeping %lu cache configurations\n", simulations.size());
+  }
+
+  std::vector<TraceRecord> batch(TRACE_BATCH);
+  size_t batchSize = 0, batchPos = 0;
+  uint64_t accessCount = 0;
+
+  for (;;) {
+    if (batchPos == batchSize) {
+      batchSize = trace.next(batch.data(), batch.size());
+      batchPos = 0;
+      if (batchSize == 0) break;
+    }
+    const TraceRecord &record = batch[batchPos++];
+    accessCount++;
+    if (verbose)
+      printf("Access %lu: %c 0x%x (%c)\n", accessCount, record.op,
+             record.addr, record.type);
+    if (!memory->isPageExist(record.addr)) memory->addPage(record.addr);
+    for (Simulation &sim : simulations) simulateAccess(sim, record);
 
-  printf("Result has been written to %s\n",
-         (std::string(traceFilePath) + ".csv").c_str());
+    if (isSingleStep) {
+      printf("Press Enter to Continue...");
+      getchar();
+    }
+  }
+  if (trace.getMalformedLines() > 0)
+    printf("Skipped %lu malformed trace lines\n", trace.getMalformedLines());
+  trace.close();
+
+  for (Simulation &sim : simulations) finishSimulation(csvFile, sim);
+  delete memory;
+
+  printf("Result has been written to %s\n", csvPath.c_str());
   csvFile.close();
   return 0;
 }
@@ -65,6 +145,19 @@ bool parseParameters(int argc, char **argv) {
       case 's':
         isSingleStep = 1;
         break;
+      case 'o':
+        if (argv[i][2] != '\0' || i + 1 == argc) return false;
+        outputPath = argv[++i];
+        break;
+      case 'c':
+        if (argv[i][2] != '\0' || i + 1 == argc) return false;
+        if (!parseSweep(argv[++i])) return false;
+        break;
+      case '\0':
+        // "-" is the trace on stdin
+        if (traceFilePath != nullptr) return false;
+        traceFilePath = argv[i];
+        break;
       default:
         return false;
       }
@@ -79,12 +172,84 @@ bool parseParameters(int argc, char **argv) {
   if (traceFilePath == nullptr) {
     return false;
   }
+  if (outputPath == nullptr && strcmp(traceFilePath, "-") == 0) {
+    printf("Reading the trace from stdin needs -o\n");
+    return false;
+  }
+  return true;
+}
+
+// Values of one -c field, comma separated, with an optional K or M suffix.
+// Empty values, as in a trailing comma, are an error.
+static bool parseSizes(const char *p, const char *end,
+                       std::vector<uint32_t> &values) {
+  for (;;) {
+    char *next;
+    unsigned long n = strtoul(p, &next, 10);
+    if (next == p || n == 0) return false;
+    if (next < end && (*next == 'K' || *next == 'k')) {
+      n *= 1024;
+      ++next;
+    } else if (next < end && (*next == 'M' || *next == 'm')) {
+      n *= 1024 * 1024;
+      ++next;
+    }
+    if (n > UINT32_MAX) return false;
+    values.push_back(uint32_t(n));
+    if (next == end) return true;
+    if (*next != ',') return false;
+    p = next + 1;
+  }
+}
+
+static bool isPowerOfTwo(uint32_t n) { return n > 0 && (n & (n - 1)) == 0; }
+
+// -c <sizes>:<block sizes>:<associativities> adds every combination of the
+// listed values that makes a valid cache, false when none does
+bool parseSweep(const char *arg) {
+  const char *first = strchr(arg, ':');
+  const char *second = first ? strchr(first + 1, ':') : nullptr;
+  if (second == nullptr) return false;
+  std::vector<uint32_t> sizes, blockSizes, associativities;
+  if (!parseSizes(arg, first, sizes) ||
+      !parseSizes(first + 1, second, blockSizes) ||
+      !parseSizes(second + 1, second + strlen(second), associativities))
+    return false;
+  size_t added = 0;
+  for (uint32_t cacheSize : sizes) {
+    for (uint32_t blockSize : blockSizes) {
+      for (uint32_t associativity : associativities) {
+        uint32_t blockNum = cacheSize / blockSize;
+        if (!isPowerOfTwo(cacheSize) || !isPowerOfTwo(blockSize) ||
+            blockSize > cacheSize || blockNum % associativity != 0 ||
+            !isPowerOfTwo(blockNum / associativity)) {
+          printf("Skipping %u B cache of %u B blocks, %u-way: invalid\n",
+                 cacheSize, blockSize, associativity);
+          continue;
+        }
+        sweepConfigs.push_back(
+            CacheConfig{cacheSize, blockSize, associativity});
+        added++;
+      }
+    }
+  }
+  if (added == 0) {
+    printf("No valid cache in -c %s\n", arg);
+    return false;
+  }
   return true;
 }
 
 void printUsage() {
-  printf("Usage: CacheSim trace-file [-s] [-v]\n");
-  printf("Parameters: -s single step, -v verbose output\n");
+  printf("Usage: CacheSim trace-file|- [-s] [-v] [-o csv-file] "
+         "[-c sizes:block-sizes:associativities]...\n");
+  printf("Parameters: -s single step, -v verbose output, -o results file "
+         "(default trace-file.csv)\n");
+  printf("            - reads the trace from stdin\n");
+  printf("            -c unified caches of every combination of the comma "
+         "separated values (e.g. 8K,16K:32,64:1,2,4)\n");
+  printf("            simulated in one pass over the trace, one CSV row "
+         "each\n");
 }
 
 Cache::Policy createSingleLevelPolicy(uint32_t cacheSize,
@@ -97,104 +262,102 @@ Cache::Policy createSingleLevelPolicy(uint32_t cacheSize,
     policy.associativity = associativity;
     policy.hitLatency = 1;
     policy.missLatency = 100;
+    // The trace only drives statistics, so no block data is kept
+    policy.tagOnly = true;
+    policy.replacement = REPLACE_LRU;
+    policy.oracle = nullptr;
+    policy.victimEntries = 0;
+    policy.victimLatency = 2;
+    policy.prefetcher = PREFETCH_NONE;
+    policy.prefetchTableSize = 0;
+    policy.prefetchDegree = 0;
+    policy.prefetchDistance = 0;
+    policy.mshrEntries = 0;
+    policy.dram = nullptr;
+    policy.inclusion = INCLUSION_NINE;
+    policy.writePolicy = WRITE_BACK;
+    policy.writeMiss = WRITE_ALLOCATE;
+    policy.writeBufferEntries = 0;
     return policy;
 }
 
-void simulateCache(std::ofstream &csvFile, bool isSplit) {
-  MemoryManager *memory = new MemoryManager();
-  std::string configStr; 
+Simulation createSimulation(MemoryManager *memory, const CacheConfig &config,
+                            bool isSplit) {
   Cache *dCache = nullptr; 
   ICache *iCache = nullptr; 
 
   if (isSplit) {
-    uint32_t cacheSizeEach = 8 * 1024; 
-    uint32_t blockSize = 64;
-    uint32_t associativity = 1; 
+    uint32_t cacheSizeEach = config.cacheSize / 2; 
 
-    Cache::Policy iPolicy = createSingleLevelPolicy(cacheSizeEach, blockSize, associativity);
-    Cache::Policy dPolicy = createSingleLevelPolicy(cacheSizeEach, blockSize, associativity);
+    Cache::Policy iPolicy = createSingleLevelPolicy(
+        cacheSizeEach, config.blockSize, config.associativity);
+    Cache::Policy dPolicy = createSingleLevelPolicy(
+        cacheSizeEach, config.blockSize, config.associativity);
 
     iCache = new ICache(memory, iPolicy); 
     dCache = new Cache(memory, dPolicy);  
 
-    memory->setCache(iCache); 
-    memory->setCache(dCache);
     iCache->printInfo(false);
     dCache->printInfo(false);
   } 
   else {
-    uint32_t cacheSize = 16 * 1024; 
-    uint32_t blockSize = 64;
-    uint32_t associativity = 1; 
-
-    Cache::Policy policy = createSingleLevelPolicy(cacheSize, blockSize, associativity);
+    Cache::Policy policy = createSingleLevelPolicy(
+        config.cacheSize, config.blockSize, config.associativity);
     dCache = new Cache(memory, policy); 
-    memory->setCache(dCache);
-    dCache->printInfo(false);
+    if (sweepConfigs.empty()) dCache->printInfo(false);
   }
+  return Simulation{config, dCache, iCache};
+}
 
-  // Read and execute trace in cache-trace/ folder
-  std::ifstream trace(traceFilePath);
-  if (!trace.is_open()) {
-    printf("Unable to open file %s\n", traceFilePath);
-    delete memory;
-    delete dCache;
-    if (iCache) delete iCache;
-    exit(-1);
-  }
-
-  char op; //'r' for read, 'w' for write
-  uint32_t addr;
-  char type;
-  uint64_t accessCount = 0;
-
-  while (trace >> op >> std::hex >> addr >> type) {
-    accessCount++;
-    if (verbose) printf("Access %lu: %c 0x%x (%c)\n", accessCount, op, addr, type);
-    if (!memory->isPageExist(addr)) memory->addPage(addr);
-    if (isSplit) {
-      if (type == 'I') {
-        if (op == 'r') {
-            iCache->getByte(addr);
-        } else {
-            iCache->setByte(addr, 0); 
-        }
-        if (verbose) iCache->printInfo(true); 
-      } 
-      else if (type == 'D') {
-        if (op == 'r') {
-          dCache->getByte(addr);
-        } else if (op == 'w') {
-          dCache->setByte(addr, 0);
-        } else {
-          dbgprintf("Illegal op '%c' in trace\n", op); 
-          continue;
-        }
-        if (verbose) dCache->printInfo(true); 
-      } 
-      else {
-        dbgprintf("Illegal type '%c' in trace\n", type);
-        continue; 
+void simulateAccess(Simulation &sim, const TraceRecord &record) {
+  char op = record.op; //'r' for read, 'w' for write
+  uint32_t addr = record.addr;
+  char type = record.type;
+  Cache *dCache = sim.dCache;
+  ICache *iCache = sim.iCache;
+  if (iCache) {
+    if (type == 'I') {
+      if (op == 'r') {
+          iCache->getByte(addr);
+      } else {
+          iCache->setByte(addr, 0); 
       }
+      if (verbose) iCache->printInfo(true); 
     } 
-    else {
+    else if (type == 'D') {
       if (op == 'r') {
-          dCache->getByte(addr);
+        dCache->getByte(addr);
       } else if (op == 'w') {
-          dCache->setByte(addr, 0);
+        dCache->setByte(addr, 0);
       } else {
-          dbgprintf("Illegal op '%c' in trace\n", op);
-          continue; 
+        dbgprintf("Illegal op '%c' in trace\n", op); 
+        return;
       }
-      if (verbose) dCache->printInfo(true);
+      if (verbose) dCache->printInfo(true); 
+    } 
+    else {
+      dbgprintf("Illegal type '%c' in trace\n", type);
+      return; 
     }
-
-    if (isSingleStep) {
-      printf("Press Enter to Continue...");
-      getchar();
+  } 
+  else {
+    if (op == 'r') {
+        dCache->getByte(addr);
+    } else if (op == 'w') {
+        dCache->setByte(addr, 0);
+    } else {
+        dbgprintf("Illegal op '%c' in trace\n", op);
+        return; 
     }
+    if (verbose) dCache->printInfo(true);
   }
-  trace.close();
+}
+
+void finishSimulation(std::ofstream &csvFile, Simulation &sim) {
+  const CacheConfig &config = sim.config;
+  Cache *dCache = sim.dCache;
+  ICache *iCache = sim.iCache;
+  bool isSplit = iCache != nullptr;
 
   if (isSplit) {
     printf("\n--- Split Cache Simulation Results ---\n");
@@ -216,33 +379,31 @@ void simulateCache(std::ofstream &csvFile, bool isSplit) {
     printf("  Miss Rate:      %.4f\n", combinedMissRate);
     printf("  Total Cycles:   %llu\n", totalCycles);
 
-    uint32_t cacheSizeEach = 8 * 1024; 
-    uint32_t totalCacheSize = cacheSizeEach * 2;
-    uint32_t blockSize = 64;
-    uint32_t associativity = 1; 
-
-    csvFile << totalCacheSize << "," << blockSize << "," << associativity << ","
-            << combinedMissRate << "," << totalCycles << std::endl;
+    csvFile << config.cacheSize << "," << config.blockSize << ","
+            << config.associativity << "," << combinedMissRate << ","
+            << totalCycles << std::endl;
   } 
   else {
-    printf("\n--- Unified Cache Simulation Results ---\n");
-    dCache->printStatistics();
-
     uint64_t totalHits = dCache->statistics.numHit;
     uint64_t totalMisses = dCache->statistics.numMiss;
     uint64_t totalAccesses = totalHits + totalMisses;
     uint64_t totalCycles = dCache->statistics.totalCycles;
     float missRate = (totalAccesses == 0) ? 0.0f : (float)totalMisses / totalAccesses;
 
-    uint32_t cacheSize = 16 * 1024; 
-    uint32_t blockSize = 64;
-    uint32_t associativity = 1;
+    if (sweepConfigs.empty()) {
+      printf("\n--- Unified Cache Simulation Results ---\n");
+      dCache->printStatistics();
+    } else {
+      printf("%u B, %u B blocks, %u-way: miss rate %.4f, %lu cycles\n",
+             config.cacheSize, config.blockSize, config.associativity,
+             missRate, totalCycles);
+    }
 
-    csvFile << cacheSize << "," << blockSize << "," << associativity << ","
-            << missRate << "," << totalCycles << std::endl;
+    csvFile << config.cacheSize << "," << config.blockSize << ","
+            << config.associativity << "," << missRate << "," << totalCycles
+            << std::endl;
   }
 
   delete dCache;
   if (iCache) delete iCache;
-  delete memory;
 }
@@ -0,0 +1,330 @@
+#include <algorithm>
+#include <cstring>
+#include <initializer_list>
+
+#include "Prefetcher.h"
+
+Prefetcher *createPrefetcher(PrefetcherKind kind, uint32_t tableSize,
+                             uint32_t degree, uint32_t distance,
+                             uint32_t blockSize) {
+  switch (kind) {
+  case PREFETCH_STRIDE:
+    return new StridePrefetcher(tableSize, degree, distance, blockSize);
+  case PREFETCH_NEXT_LINE:
+    return new NextLinePrefetcher(degree, distance, blockSize);
+  case PREFETCH_BOP:
+    return new BestOffsetPrefetcher(degree, blockSize);
+  case PREFETCH_SMS:
+    return new SmsPrefetcher(tableSize, blockSize);
+  case PREFETCH_NONE:
+  case PREFETCH_STREAM:
+    break;
+  }
+  return nullptr;
+}
+
+static const char *prefetcherNames[] = {"none",   "stride", "next-line",
+                                        "stream", "bop",    "sms"};
+
+const char *prefetcherName(PrefetcherKind kind) {
+  return prefetcherNames[kind];
+}
+
+bool parsePrefetcher(const char *name, PrefetcherKind *kind) {
+  for (uint32_t i = 0; i < sizeof(prefetcherNames) / sizeof(char *); ++i) {
+    if (strcmp(name, prefetcherNames[i]) == 0) {
+      *kind = PrefetcherKind(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+StridePrefetcher::StridePrefetcher(uint32_t tableSize, uint32_t degree,
+                                   uint32_t distance, uint32_t blockSize) {
+  if (tableSize == 0) tableSize = DEFAULT_TABLE_SIZE;
+  this->table = std::vector<Entry>(tableSize, Entry{0, 0, 0, INITIAL, false});
+  this->degree = degree ? degree : DEFAULT_DEGREE;
+  this->distance = distance ? distance : DEFAULT_DISTANCE;
+  this->blockSize = blockSize;
+}
+
+StridePrefetcher::Entry &StridePrefetcher::lookup(uint32_t key) {
+  // Fibonacci hashing spreads nearby PCs and regions over the table
+  uint32_t index = uint32_t((key * 2654435761u) >> 8) % this->table.size();
+  return this->table[index];
+}
+
+void StridePrefetcher::observe(uint32_t addr, uint32_t pc, bool miss,
+                               std::vector<uint32_t> &prefetches) {
+  uint32_t key = pc != 0 ? pc : addr >> REGION_BITS;
+  Entry &entry = this->lookup(key);
+
+  if (!entry.valid || entry.key != key) {
+    Entry fresh = Entry{key, addr, 0, INITIAL, true};
+    // A stream running into the next region keeps its training
+    if (pc == 0) {
+      for (uint32_t neighbour : {key - 1, key + 1}) {
+        const Entry &from = this->lookup(neighbour);
+        if (from.valid && from.key == neighbour && from.stride != 0 &&
+            int32_t(addr - from.lastAddr) == from.stride) {
+          fresh.stride = from.stride;
+          fresh.state = from.state;
+          break;
+        }
+      }
+    }
+    entry = fresh;
+  } else {
+    int32_t stride = int32_t(addr - entry.lastAddr);
+    entry.lastAddr = addr;
+    if (stride == 0) return;
+    if (stride == entry.stride) {
+      entry.state = entry.state == NO_PREDICTION ? TRANSIENT : STEADY;
+    } else {
+      switch (entry.state) {
+      case STEADY:
+        // Keep the stride through one irregular access
+        entry.state = INITIAL;
+        break;
+      case INITIAL:
+        entry.state = TRANSIENT;
+        entry.stride = stride;
+        break;
+      default:
+        entry.state = NO_PREDICTION;
+        entry.stride = stride;
+        break;
+      }
+    }
+  }
+  if (entry.state == NO_PREDICTION || entry.stride == 0) return;
+
+  // Strides shorter than a block would keep requesting the current one,
+  // step a whole block in their direction instead
+  int64_t step = entry.stride;
+  if (step > -int64_t(this->blockSize) && step < int64_t(this->blockSize))
+    step = step > 0 ? int64_t(this->blockSize) : -int64_t(this->blockSize);
+  for (uint32_t i = 0; i < this->degree; ++i) {
+    prefetches.push_back(uint32_t(addr + step * (this->distance + i)));
+  }
+}
+
+NextLinePrefetcher::NextLinePrefetcher(uint32_t degree, uint32_t distance,
+                                       uint32_t blockSize) {
+  this->degree = degree ? degree : DEFAULT_DEGREE;
+  this->distance = distance ? distance : DEFAULT_DISTANCE;
+  this->blockSize = blockSize;
+}
+
+void NextLinePrefetcher::observe(uint32_t addr, uint32_t pc, bool miss,
+                                 std::vector<uint32_t> &prefetches) {
+  if (!miss) return;
+  uint32_t blockAddr = addr & ~(this->blockSize - 1);
+  for (uint32_t i = 0; i < this->degree; ++i) {
+    prefetches.push_back(blockAddr + (this->distance + i) * this->blockSize);
+  }
+}
+
+static uint32_t log2i(uint32_t val) {
+  uint32_t ret = 0;
+  while ((1u << ret) < val) ret++;
+  return ret;
+}
+
+BestOffsetPrefetcher::BestOffsetPrefetcher(uint32_t degree,
+                                           uint32_t blockSize) {
+  this->degree = degree ? degree : DEFAULT_DEGREE;
+  this->blockBits = log2i(blockSize);
+  for (uint32_t d = 1; d <= MAX_OFFSET; ++d) {
+    uint32_t n = d;
+    for (uint32_t p : {2u, 3u, 5u}) {
+      while (n % p == 0) n /= p;
+    }
+    if (n == 1) this->offsets.push_back(d);
+  }
+  this->scores = std::vector<uint32_t>(this->offsets.size(), 0);
+  this->recentRequests = std::vector<uint32_t>(RR_ENTRIES, 0);
+  this->testIndex = 0;
+  this->round = 0;
+  // Behave like next-line until the first phase has learnt better
+  this->bestOffset = 1;
+}
+
+void BestOffsetPrefetcher::observe(uint32_t addr, uint32_t pc, bool miss,
+                                   std::vector<uint32_t> &prefetches) {
+  if (!miss) return;
+  uint32_t block = addr >> this->blockBits;
+
+  uint32_t base = block - this->offsets[this->testIndex];
+  if (this->recentRequests[this->rrIndex(base)] == base + 1 &&
+      ++this->scores[this->testIndex] >= SCORE_MAX) {
+    this->endLearning();
+  } else if (++this->testIndex == this->offsets.size()) {
+    this->testIndex = 0;
+    if (++this->round == ROUND_MAX) this->endLearning();
+  }
+  this->recentRequests[this->rrIndex(block)] = block + 1;
+
+  if (this->bestOffset == 0) return;
+  for (uint32_t i = 1; i <= this->degree; ++i) {
+    prefetches.push_back((block + this->bestOffset * i) << this->blockBits);
+  }
+}
+
+void BestOffsetPrefetcher::endLearning() {
+  uint32_t best = 0;
+  for (uint32_t i = 1; i < this->scores.size(); ++i) {
+    if (this->scores[i] > this->scores[best]) best = i;
+  }
+  this->bestOffset =
+      this->scores[best] > BAD_SCORE ? this->offsets[best] : 0;
+  std::fill(this->scores.begin(), this->scores.end(), 0);
+  this->testIndex = 0;
+  this->round = 0;
+}
+
+SmsPrefetcher::SmsPrefetcher(uint32_t tableSize, uint32_t blockSize) {
+  if (tableSize == 0) tableSize = DEFAULT_TABLE_SIZE;
+  this->blockBits = log2i(blockSize);
+  this->regionBits = this->blockBits + log2i(REGION_BLOCKS);
+  this->generations =
+      std::vector<Generation>(GENERATIONS, Generation{0, 0, 0, 0, false});
+  this->patterns = std::vector<Pattern>(tableSize, Pattern{0, 0, false});
+  this->clock = 0;
+}
+
+SmsPrefetcher::Generation *SmsPrefetcher::findGeneration(uint32_t region) {
+  for (Generation &generation : this->generations) {
+    if (generation.valid && generation.region == region) return &generation;
+  }
+  return nullptr;
+}
+
+void SmsPrefetcher::observe(uint32_t addr, uint32_t pc, bool miss,
+                            std::vector<uint32_t> &prefetches) {
+  uint32_t region = addr >> this->regionBits;
+  uint32_t offset = (addr >> this->blockBits) % REGION_BLOCKS;
+  this->clock++;
+
+  Generation *current = this->findGeneration(region);
+  if (current != nullptr) {
+    current->footprint |= 1u << offset;
+    current->lastUse = this->clock;
+    return;
+  }
+
+  // Trigger access, the least recently used generation makes room
+  Generation *victim = &this->generations[0];
+  for (Generation &generation : this->generations) {
+    if (!generation.valid) {
+      victim = &generation;
+      break;
+    }
+    if (generation.lastUse < victim->lastUse) victim = &generation;
+  }
+  if (victim->valid) this->commit(*victim);
+  uint32_t key = pc * REGION_BLOCKS + offset;
+  *victim = Generation{region, key, 1u << offset, this->clock, true};
+
+  const Pattern &pattern =
+      this->patterns[((key * 2654435761u) >> 8) % this->patterns.size()];
+  if (!pattern.valid || pattern.key != key) return;
+  uint32_t regionAddr = region << this->regionBits;
+  for (uint32_t i = 0; i < REGION_BLOCKS; ++i) {
+    if (i != offset && (pattern.footprint & (1u << i)))
+      prefetches.push_back(regionAddr + (i << this->blockBits));
+  }
+}
+
+void SmsPrefetcher::evicted(uint32_t blockAddr) {
+  Generation *generation = this->findGeneration(blockAddr >> this->regionBits);
+  if (generation == nullptr) return;
+  this->commit(*generation);
+  generation->valid = false;
+}
+
+void SmsPrefetcher::commit(Generation &generation) {
+  Pattern &pattern =
+      this->patterns[((generation.key * 2654435761u) >> 8) %
+                     this->patterns.size()];
+  pattern = Pattern{generation.key, generation.footprint, true};
+}
+
+StreamBuffers::StreamBuffers(uint32_t count, uint32_t depth,
+                             uint32_t blockSize, bool keepData) {
+  if (count == 0) count = DEFAULT_COUNT;
+  this->depth = depth ? depth : DEFAULT_DEPTH;
+  this->blockSize = blockSize;
+  uint32_t slots = count * this->depth;
+  this->addrs = std::vector<uint32_t>(slots, 0);
+  this->valid = std::vector<uint8_t>(slots, 0);
+  this->ready = std::vector<uint64_t>(slots, 0);
+  if (keepData) this->data = std::vector<uint8_t>(size_t(slots) * blockSize);
+  this->head = std::vector<uint32_t>(count, 0);
+  this->size = std::vector<uint32_t>(count, 0);
+  this->next = std::vector<uint32_t>(count, 0);
+  this->lastUse = std::vector<uint64_t>(count, 0);
+}
+
+int32_t StreamBuffers::findHead(uint32_t blockAddr) const {
+  for (uint32_t b = 0; b < this->size.size(); ++b) {
+    // Heads are always valid, see dropInvalidHead()
+    if (this->size[b] > 0 && this->addrs[this->slot(b, 0)] == blockAddr)
+      return b;
+  }
+  return -1;
+}
+
+const uint8_t *StreamBuffers::getHeadData(uint32_t buffer) const {
+  if (this->data.empty()) return nullptr;
+  return &this->data[size_t(this->slot(buffer, 0)) * this->blockSize];
+}
+
+bool StreamBuffers::contains(uint32_t blockAddr) const {
+  for (uint32_t s = 0; s < this->addrs.size(); ++s) {
+    if (this->valid[s] && this->addrs[s] == blockAddr) return true;
+  }
+  return false;
+}
+
+void StreamBuffers::invalidate(uint32_t blockAddr) {
+  for (uint32_t b = 0; b < this->size.size(); ++b) {
+    for (uint32_t i = 0; i < this->size[b]; ++i) {
+      uint32_t s = this->slot(b, i);
+      if (this->valid[s] && this->addrs[s] == blockAddr) this->valid[s] = 0;
+    }
+    this->dropInvalidHead(b);
+  }
+}
+
+void StreamBuffers::dropInvalidHead(uint32_t buffer) {
+  while (this->size[buffer] > 0 && !this->valid[this->slot(buffer, 0)]) {
+    this->head[buffer] = (this->head[buffer] + 1) % this->depth;
+    this->size[buffer]--;
+  }
+}
+
+uint32_t StreamBuffers::allocate(uint32_t firstAddr, uint64_t stamp) {
+  uint32_t victim = 0;
+  for (uint32_t b = 1; b < this->size.size(); ++b) {
+    if (this->lastUse[b] < this->lastUse[victim]) victim = b;
+  }
+  for (uint32_t i = 0; i < this->size[victim]; ++i)
+    this->valid[this->slot(victim, i)] = 0;
+  this->head[victim] = 0;
+  this->size[victim] = 0;
+  this->next[victim] = firstAddr;
+  this->lastUse[victim] = stamp;
+  return victim;
+}
+
+uint8_t *StreamBuffers::push(uint32_t buffer) {
+  uint32_t s = this->slot(buffer, this->size[buffer]);
+  this->addrs[s] = this->next[buffer];
+  this->valid[s] = 1;
+  this->size[buffer]++;
+  this->next[buffer] += this->blockSize;
+  if (this->data.empty()) return nullptr;
+  return &this->data[size_t(s) * this->blockSize];
+}
@@ -0,0 +1,353 @@
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <cstring>
+
+#include "Replacement.h"
+
+// Out-of-line definitions of the constants bound to references below
+const uint16_t LruReplacement::NIL;
+const uint8_t RripReplacement::MAX_RRPV;
+const uint64_t TraceOracle::NEVER;
+
+ReplacementPolicy *createReplacementPolicy(ReplacementKind kind,
+                                           const TraceOracle *oracle) {
+  switch (kind) {
+  case REPLACE_LRU:
+    return new LruReplacement();
+  case REPLACE_FIFO:
+    return new FifoReplacement();
+  case REPLACE_PLRU:
+    return new PlruReplacement();
+  case REPLACE_NRU:
+    return new NruReplacement();
+  case REPLACE_RANDOM:
+    return new RandomReplacement();
+  case REPLACE_SRRIP:
+    return new RripReplacement(RripReplacement::SRRIP);
+  case REPLACE_BRRIP:
+    return new RripReplacement(RripReplacement::BRRIP);
+  case REPLACE_DRRIP:
+    return new RripReplacement(RripReplacement::DRRIP);
+  case REPLACE_OPT:
+    if (oracle == nullptr) {
+      fprintf(stderr, "OPT replacement needs a trace oracle\n");
+      exit(-1);
+    }
+    return new OptReplacement(oracle);
+  }
+  return nullptr;
+}
+
+static const char *replacementNames[] = {"lru",   "fifo",  "plru",
+                                         "nru",   "random", "srrip",
+                                         "brrip", "drrip", "opt"};
+
+const char *replacementName(ReplacementKind kind) {
+  return replacementNames[kind];
+}
+
+bool parseReplacement(const char *name, ReplacementKind *kind) {
+  for (uint32_t i = 0; i < sizeof(replacementNames) / sizeof(char *); ++i) {
+    if (strcmp(name, replacementNames[i]) == 0) {
+      *kind = ReplacementKind(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+void LruReplacement::init(uint32_t setNum, uint32_t ways, uint32_t strideBits) {
+  if (ways >= NIL) {
+    fprintf(stderr, "LRU supports at most %d ways\n", NIL - 1);
+    exit(-1);
+  }
+  this->strideBits = strideBits;
+  size_t lineNum = size_t(setNum) << strideBits;
+  this->prev = std::vector<uint16_t>(lineNum, NIL);
+  this->next = std::vector<uint16_t>(lineNum, NIL);
+  this->stamps = std::vector<uint64_t>(lineNum, 0);
+  this->head = std::vector<uint16_t>(setNum);
+  this->tail = std::vector<uint16_t>(setNum);
+  // MRU -> LRU is ways-1 ... 0, so way 0 is filled first
+  for (uint32_t id = 0; id < setNum; ++id) {
+    uint32_t base = id << strideBits;
+    for (uint32_t i = 0; i < ways; ++i) {
+      this->prev[base + i] = i + 1 < ways ? i + 1 : NIL;
+      this->next[base + i] = i > 0 ? i - 1 : NIL;
+    }
+    this->head[id] = ways - 1;
+    this->tail[id] = 0;
+  }
+}
+
+void LruReplacement::unlink(uint32_t id, uint16_t way) {
+  uint32_t base = id << this->strideBits;
+  uint16_t p = this->prev[base + way], n = this->next[base + way];
+  if (p != NIL) this->next[base + p] = n; else this->head[id] = n;
+  if (n != NIL) this->prev[base + n] = p; else this->tail[id] = p;
+}
+
+// Insert way in front of pos, or at the tail when pos is NIL
+void LruReplacement::insertBefore(uint32_t id, uint16_t way, uint16_t pos) {
+  uint32_t base = id << this->strideBits;
+  uint16_t p = pos != NIL ? this->prev[base + pos] : this->tail[id];
+  this->prev[base + way] = p;
+  this->next[base + way] = pos;
+  if (p != NIL) this->next[base + p] = way; else this->head[id] = way;
+  if (pos != NIL) this->prev[base + pos] = way; else this->tail[id] = way;
+}
+
+void LruReplacement::touch(uint32_t line, uint32_t addr, uint64_t stamp) {
+  uint32_t id = line >> this->strideBits;
+  uint32_t base = id << this->strideBits;
+  uint16_t way = line - base;
+  // Valid lines always carry a non-zero stamp
+  stamp++;
+  this->stamps[line] = stamp;
+  uint16_t pos = this->head[id];
+  if (pos == way && (this->next[line] == NIL ||
+                     this->stamps[base + this->next[line]] != stamp ||
+                     this->next[line] < way))
+    return;
+  this->unlink(id, way);
+  pos = this->head[id];
+  while (pos != NIL && this->stamps[base + pos] == stamp && pos > way)
+    pos = this->next[base + pos];
+  this->insertBefore(id, way, pos);
+}
+
+void LruReplacement::invalidate(uint32_t line) {
+  uint32_t id = line >> this->strideBits;
+  uint32_t base = id << this->strideBits;
+  uint16_t way = line - base;
+  this->unlink(id, way);
+  this->stamps[line] = 0;
+  // Keep invalid ways in index order behind the valid ones
+  uint16_t pos = this->tail[id];
+  uint16_t after = NIL;
+  while (pos != NIL && this->stamps[base + pos] == 0 && pos < way) {
+    after = pos;
+    pos = this->prev[base + pos];
+  }
+  this->insertBefore(id, way, after);
+}
+
+void PlruReplacement::init(uint32_t setNum, uint32_t ways, uint32_t strideBits) {
+  if ((ways & (ways - 1)) != 0) {
+    fprintf(stderr, "Tree PLRU needs a power of two associativity, got %d\n",
+            ways);
+    exit(-1);
+  }
+  this->ways = ways;
+  this->strideBits = strideBits;
+  this->bits = std::vector<uint8_t>(size_t(setNum) * ways, 0);
+}
+
+void PlruReplacement::touch(uint32_t line, uint32_t addr, uint64_t stamp) {
+  uint32_t id = line >> this->strideBits;
+  uint32_t way = line - (id << this->strideBits);
+  uint8_t *tree = &this->bits[size_t(id) * this->ways];
+  // Leaves are nodes ways .. 2 * ways - 1, point every ancestor away
+  for (uint32_t node = this->ways + way; node > 1; node >>= 1)
+    tree[node >> 1] = (node & 1) ? 0 : 1;
+}
+
+uint32_t PlruReplacement::victim(uint32_t id) {
+  const uint8_t *tree = &this->bits[size_t(id) * this->ways];
+  uint32_t node = 1;
+  while (node < this->ways) node = 2 * node + tree[node];
+  return (id << this->strideBits) + (node - this->ways);
+}
+
+void NruReplacement::init(uint32_t setNum, uint32_t ways, uint32_t strideBits) {
+  this->ways = ways;
+  this->words = (ways + 63) / 64;
+  this->strideBits = strideBits;
+  this->referenced = std::vector<uint64_t>(size_t(setNum) * this->words, 0);
+  this->count = std::vector<uint32_t>(setNum, 0);
+}
+
+void NruReplacement::touch(uint32_t line, uint32_t addr, uint64_t stamp) {
+  uint32_t id = line >> this->strideBits;
+  uint32_t way = line - (id << this->strideBits);
+  uint64_t *set = &this->referenced[size_t(id) * this->words];
+  uint64_t bit = uint64_t(1) << (way & 63);
+  if (set[way >> 6] & bit) return;
+  set[way >> 6] |= bit;
+  if (++this->count[id] < this->ways) return;
+  // Every way is referenced, keep only the newest one
+  memset(set, 0, this->words * sizeof(uint64_t));
+  set[way >> 6] = bit;
+  this->count[id] = 1;
+}
+
+void NruReplacement::invalidate(uint32_t line) {
+  uint32_t id = line >> this->strideBits;
+  uint32_t way = line - (id << this->strideBits);
+  uint64_t *set = &this->referenced[size_t(id) * this->words];
+  uint64_t bit = uint64_t(1) << (way & 63);
+  if (set[way >> 6] & bit) {
+    set[way >> 6] &= ~bit;
+    this->count[id]--;
+  }
+}
+
+uint32_t NruReplacement::victim(uint32_t id) {
+  const uint64_t *set = &this->referenced[size_t(id) * this->words];
+  for (uint32_t w = 0; w < this->words; ++w) {
+    uint64_t clear = ~set[w];
+    if (clear == 0) continue;
+    uint32_t way = w * 64 + __builtin_ctzll(clear);
+    if (way < this->ways) return (id << this->strideBits) + way;
+  }
+  // Only a direct-mapped set can have every way referenced
+  return id << this->strideBits;
+}
+
+void RandomReplacement::init(uint32_t setNum, uint32_t ways, uint32_t strideBits) {
+  this->ways = ways;
+  this->strideBits = strideBits;
+  this->state = 0x2545F4914F6CDD1DULL;
+}
+
+void RripReplacement::init(uint32_t setNum, uint32_t ways, uint32_t strideBits) {
+  this->ways = ways;
+  this->strideBits = strideBits;
+  this->rrpv = std::vector<uint8_t>(size_t(setNum) << strideBits, MAX_RRPV);
+  this->bimodalCounter = 0;
+  this->psel = (PSEL_MAX + 1) / 2;
+  this->role = std::vector<uint8_t>(setNum, FOLLOWER);
+  // A single set cannot hold a leader of each policy, so it never duels
+  if (this->mode == DRRIP && setNum < 2) this->mode = SRRIP;
+  if (this->mode != DRRIP) return;
+  // Spread the leaders evenly: the first set of every constituency leads
+  // for SRRIP and the second for BRRIP. Caches with fewer than 64 sets
+  // give each policy one leader per two sets.
+  uint32_t constituency = setNum / LEADER_SETS;
+  if (constituency < 2) constituency = 2;
+  for (uint32_t id = 0; id + 1 < setNum; id += constituency) {
+    this->role[id] = SRRIP_LEADER;
+    this->role[id + 1] = BRRIP_LEADER;
+  }
+}
+
+void RripReplacement::insert(uint32_t line, uint32_t addr, uint64_t stamp) {
+  bool bimodal = this->mode == BRRIP;
+  if (this->mode == DRRIP) {
+    // Every fill is a miss in its set, leaders steer PSEL towards the
+    // policy that misses less
+    uint8_t r = this->role[line >> this->strideBits];
+    if (r == SRRIP_LEADER) {
+      if (this->psel < PSEL_MAX) this->psel++;
+    } else if (r == BRRIP_LEADER) {
+      if (this->psel > 0) this->psel--;
+    }
+    bimodal = r == BRRIP_LEADER ||
+              (r == FOLLOWER && this->psel > PSEL_MAX / 2);
+  }
+  if (bimodal && (this->bimodalCounter++ % BIMODAL_PERIOD) != 0) {
+    this->rrpv[line] = MAX_RRPV;
+  } else {
+    this->rrpv[line] = MAX_RRPV - 1;
+  }
+}
+
+uint32_t RripReplacement::victim(uint32_t id) {
+  uint32_t begin = id << this->strideBits;
+  uint8_t *set = &this->rrpv[begin];
+  uint8_t oldest = 0;
+  for (uint32_t i = 0; i < this->ways; ++i) {
+    if (set[i] > oldest) oldest = set[i];
+  }
+  // Age the whole set at once until some way is predicted distant
+  if (oldest < MAX_RRPV) {
+    uint8_t delta = MAX_RRPV - oldest;
+    for (uint32_t i = 0; i < this->ways; ++i) set[i] += delta;
+  }
+  for (uint32_t i = 0; i < this->ways; ++i) {
+    if (set[i] == MAX_RRPV) return begin + i;
+  }
+  return begin;
+}
+
+TraceOracle::TraceOracle(uint32_t blockSize) {
+  this->offsetBits = 0;
+  while ((1u << this->offsetBits) < blockSize) this->offsetBits++;
+  this->now = 0;
+}
+
+void TraceOracle::addAccess(uint32_t addr) {
+  if (this->blocks.size() == UINT32_MAX) {
+    fprintf(stderr, "Trace too long for OPT replacement\n");
+    exit(-1);
+  }
+  uint32_t block = addr >> this->offsetBits;
+  this->positions[block].push_back(this->blocks.size());
+  this->blocks.push_back(block);
+}
+
+void TraceOracle::finish() {
+  this->nextSame = std::vector<uint32_t>(this->blocks.size(), UINT32_MAX);
+  for (auto &entry : this->positions) {
+    const std::vector<uint32_t> &list = entry.second;
+    for (size_t i = 0; i + 1 < list.size(); ++i)
+      this->nextSame[list[i]] = list[i + 1];
+  }
+}
+
+uint64_t TraceOracle::nextUse(uint32_t addr) const {
+  uint32_t block = addr >> this->offsetBits;
+  // Demand accesses are for the current record, a single lookup
+  if (this->now < this->blocks.size() && this->blocks[this->now] == block) {
+    uint32_t next = this->nextSame[this->now];
+    return next == UINT32_MAX ? NEVER : next;
+  }
+  // Write-backs and prefetches touch other blocks
+  auto it = this->positions.find(block);
+  if (it == this->positions.end()) return NEVER;
+  auto pos = std::upper_bound(it->second.begin(), it->second.end(), this->now);
+  return pos == it->second.end() ? NEVER : *pos;
+}
+
+void OptReplacement::init(uint32_t setNum, uint32_t ways, uint32_t strideBits) {
+  this->strideBits = strideBits;
+  size_t lineNum = size_t(setNum) << strideBits;
+  this->order = std::vector<Order>(setNum);
+  this->nextUse = std::vector<uint64_t>(lineNum, TraceOracle::NEVER);
+  this->blockAddr = std::vector<uint32_t>(lineNum, 0);
+  this->tracked = std::vector<uint8_t>(lineNum, 0);
+}
+
+void OptReplacement::update(uint32_t line, uint64_t next) {
+  Order &set = this->order[line >> this->strideBits];
+  if (this->tracked[line])
+    set.erase(std::make_pair(this->nextUse[line], line));
+  this->nextUse[line] = next;
+  this->tracked[line] = 1;
+  set.insert(std::make_pair(next, line));
+}
+
+void OptReplacement::touch(uint32_t line, uint32_t addr, uint64_t stamp) {
+  this->blockAddr[line] = addr;
+  this->update(line, this->oracle->nextUse(addr));
+}
+
+void OptReplacement::invalidate(uint32_t line) {
+  if (!this->tracked[line]) return;
+  this->order[line >> this->strideBits].erase(
+      std::make_pair(this->nextUse[line], line));
+  this->tracked[line] = 0;
+}
+
+uint32_t OptReplacement::victim(uint32_t id) {
+  Order &set = this->order[id];
+  // Lines whose predicted use has passed without reaching this level are
+  // used again later than predicted
+  uint64_t now = this->oracle->getPosition();
+  while (!set.empty() && set.begin()->first <= now) {
+    uint32_t line = set.begin()->second;
+    this->update(line, this->oracle->nextUse(this->blockAddr[line]));
+  }
+  return set.rbegin()->second;
+}
@@ -0,0 +1,80 @@
+#include "TagMatch.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define TAG_MATCH_X86
+#include <immintrin.h>
+#endif
+
+int32_t tagMatchScalar(const uint32_t *tags, uint32_t n, uint32_t tag) {
+  for (uint32_t i = 0; i < n; ++i) {
+    if (tags[i] == tag) return i;
+  }
+  return -1;
+}
+
+#ifdef TAG_MATCH_X86
+
+// Compares 4 tags per instruction
+__attribute__((target("sse2")))
+static int32_t tagMatchSSE2(const uint32_t *tags, uint32_t n, uint32_t tag) {
+  const __m128i key = _mm_set1_epi32(tag);
+  uint32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tags + i));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, key)));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  for (; i < n; ++i) {
+    if (tags[i] == tag) return i;
+  }
+  return -1;
+}
+
+// Compares 8 tags per instruction, 16 per iteration on wide sets
+__attribute__((target("avx2")))
+static int32_t tagMatchAVX2(const uint32_t *tags, uint32_t n, uint32_t tag) {
+  const __m256i key = _mm256_set1_epi32(tag);
+  uint32_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(tags + i));
+    __m256i b =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(tags + i + 8));
+    uint32_t mask =
+        uint32_t(_mm256_movemask_ps(
+            _mm256_castsi256_ps(_mm256_cmpeq_epi32(a, key)))) |
+        (uint32_t(_mm256_movemask_ps(
+             _mm256_castsi256_ps(_mm256_cmpeq_epi32(b, key))))
+         << 8);
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(tags + i));
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, key)));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  for (; i < n; ++i) {
+    if (tags[i] == tag) return i;
+  }
+  return -1;
+}
+
+#endif
+
+TagMatchFunc selectTagMatch(uint32_t associativity) {
+#ifdef TAG_MATCH_X86
+  if (associativity >= 8) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return tagMatchAVX2;
+    if (__builtin_cpu_supports("sse2")) return tagMatchSSE2;
+  }
+#endif
+  return tagMatchScalar;
+}
+
+const char *tagMatchName(TagMatchFunc func) {
+#ifdef TAG_MATCH_X86
+  if (func == tagMatchAVX2) return "avx2";
+  if (func == tagMatchSSE2) return "sse2";
+#endif
+  return "scalar";
+}
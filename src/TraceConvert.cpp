@@ -0,0 +1,57 @@
+#include <cstdint>
+#include <cstdio>
+
+#include "TraceReader.h"
+
+// Converts a text trace to the binary format. The text is read twice, the
+// first pass only decides whether the records need a PC field.
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    printf("Usage: trace-convert text-trace binary-trace\n");
+    return -1;
+  }
+  const char *inputPath = argv[1];
+  const char *outputPath = argv[2];
+
+  TraceReader input;
+  if (!input.open(inputPath)) {
+    printf("Unable to open file %s\n", inputPath);
+    return -1;
+  }
+  if (input.isBinary()) {
+    printf("%s is already a binary trace\n", inputPath);
+    return -1;
+  }
+  // The second pass would find a pipe already drained
+  if (input.isStream()) {
+    printf("trace-convert needs a trace file, not a pipe\n");
+    return -1;
+  }
+  input.setQuiet(true);
+  TraceRecord record;
+  bool withPc = false;
+  while (!withPc && input.next(record)) withPc = record.pc != 0;
+  input.close();
+  input.setQuiet(false);
+
+  TraceWriter output;
+  if (!input.open(inputPath) || !output.open(outputPath, withPc)) {
+    printf("Unable to open file %s\n", outputPath);
+    return -1;
+  }
+  uint64_t count = 0;
+  while (input.next(record)) {
+    output.write(record);
+    count++;
+  }
+  input.close();
+  if (!output.close()) {
+    printf("Unable to write file %s\n", outputPath);
+    return -1;
+  }
+  printf("Converted %lu records%s to %s\n", count, withPc ? " with PCs" : "",
+         outputPath);
+  if (input.getMalformedLines() > 0)
+    printf("Skipped %lu malformed lines\n", input.getMalformedLines());
+  return 0;
+}
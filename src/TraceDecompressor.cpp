@@ -0,0 +1,303 @@
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#ifdef TRACE_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef TRACE_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef TRACE_HAVE_LZMA
+#include <lzma.h>
+#endif
+
+#include "TraceDecompressor.h"
+
+static const char *compressionNames[] = {"plain", "gzip", "zstd", "xz"};
+static const size_t INPUT_CHUNK = 1 << 18;  // bytes read from fd at once
+static const size_t INPUT_PIECE = 1 << 30;  // bytes of input decoded at once
+
+const char *traceCompressionName(TraceCompression compression) {
+  return compressionNames[compression];
+}
+
+TraceCompression detectTraceCompression(const char *data, size_t size) {
+  static const unsigned char gzipMagic[] = {0x1f, 0x8b};
+  static const unsigned char zstdMagic[] = {0x28, 0xb5, 0x2f, 0xfd};
+  static const unsigned char xzMagic[] = {0xfd, '7', 'z', 'X', 'Z', 0x00};
+  if (size >= sizeof(gzipMagic) &&
+      memcmp(data, gzipMagic, sizeof(gzipMagic)) == 0)
+    return TRACE_GZIP;
+  if (size >= sizeof(zstdMagic) &&
+      memcmp(data, zstdMagic, sizeof(zstdMagic)) == 0)
+    return TRACE_ZSTD;
+  if (size >= sizeof(xzMagic) &&
+      memcmp(data, xzMagic, sizeof(xzMagic)) == 0)
+    return TRACE_XZ;
+  return TRACE_PLAIN;
+}
+
+bool traceCompressionSupported(TraceCompression compression) {
+  switch (compression) {
+  case TRACE_PLAIN:
+    return true;
+#ifdef TRACE_HAVE_ZLIB
+  case TRACE_GZIP:
+    return true;
+#endif
+#ifdef TRACE_HAVE_ZSTD
+  case TRACE_ZSTD:
+    return true;
+#endif
+#ifdef TRACE_HAVE_LZMA
+  case TRACE_XZ:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+TraceDecompressor::TraceDecompressor(TraceCompression compression,
+                                     const char *input, size_t inputSize,
+                                     int fd) {
+  this->compression = compression;
+  this->input = input;
+  this->inputSize = inputSize;
+  this->fd = fd;
+  this->ring = std::vector<RingBuffer>(RING_BUFFERS);
+  for (RingBuffer &buffer : this->ring) {
+    buffer.data.resize(RING_BUFFER_SIZE);
+    buffer.size = 0;
+  }
+  this->thread = std::thread(&TraceDecompressor::run, this);
+}
+
+// A thread blocked reading a pipe only notices once data or EOF arrives
+TraceDecompressor::~TraceDecompressor() {
+  {
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->stopped = true;
+  }
+  this->hasSpace.notify_one();
+  this->thread.join();
+}
+
+size_t TraceDecompressor::read(char *dst, size_t size) {
+  {
+    std::unique_lock<std::mutex> guard(this->lock);
+    this->hasData.wait(guard,
+                       [this] { return this->filled > 0 || this->finished; });
+    if (this->filled == 0) return 0;
+  }
+  // The thread does not touch published buffers, copy without the lock
+  RingBuffer &buffer = this->ring[this->tail];
+  size_t n = buffer.size - this->tailPos;
+  if (n > size) n = size;
+  memcpy(dst, buffer.data.data() + this->tailPos, n);
+  this->tailPos += n;
+  if (this->tailPos == buffer.size) {
+    this->tailPos = 0;
+    this->tail = (this->tail + 1) % RING_BUFFERS;
+    {
+      std::lock_guard<std::mutex> guard(this->lock);
+      this->filled--;
+    }
+    this->hasSpace.notify_one();
+  }
+  return n;
+}
+
+void TraceDecompressor::run() {
+  bool ok = true;
+  switch (this->compression) {
+#ifdef TRACE_HAVE_ZLIB
+  case TRACE_GZIP:
+    ok = this->inflateGzip();
+    break;
+#endif
+#ifdef TRACE_HAVE_ZSTD
+  case TRACE_ZSTD:
+    ok = this->decodeZstd();
+    break;
+#endif
+#ifdef TRACE_HAVE_LZMA
+  case TRACE_XZ:
+    ok = this->decodeXz();
+    break;
+#endif
+  default:
+    ok = false;
+    break;
+  }
+  std::unique_lock<std::mutex> guard(this->lock);
+  // A reader closing early leaves the stream unfinished on purpose
+  if (!ok && !this->stopped) {
+    fprintf(stderr, "Corrupt or truncated %s trace, reading stopped\n",
+            traceCompressionName(this->compression));
+  }
+  this->finished = true;
+  guard.unlock();
+  this->hasData.notify_one();
+}
+
+size_t TraceDecompressor::readInput(const char **data,
+                                    std::vector<char> &chunk) {
+  // Pieces of the in-memory input stay below the 32-bit lengths of zlib
+  if (this->inputSize > 0) {
+    size_t n = this->inputSize < INPUT_PIECE ? this->inputSize : INPUT_PIECE;
+    *data = this->input;
+    this->input += n;
+    this->inputSize -= n;
+    return n;
+  }
+  if (this->fd < 0) return 0;
+  *data = chunk.data();
+  for (;;) {
+    ssize_t n = ::read(this->fd, chunk.data(), chunk.size());
+    if (n >= 0) return size_t(n);
+    if (errno != EINTR) return 0;
+  }
+}
+
+bool TraceDecompressor::publish(size_t size) {
+  std::unique_lock<std::mutex> guard(this->lock);
+  if (size > 0) {
+    this->ring[this->head].size = size;
+    this->head = (this->head + 1) % RING_BUFFERS;
+    this->filled++;
+    this->hasData.notify_one();
+  }
+  this->hasSpace.wait(guard, [this] {
+    return this->filled < RING_BUFFERS || this->stopped;
+  });
+  return !this->stopped;
+}
+
+// Each decoder takes its input from readInput, asking for more only once
+// a call left room in the output, as the decoder may still hold output
+// for the input it has. It fills the buffer at head, publishing it
+// whenever it is full and once more at the end. Returns false for corrupt
+// or truncated input.
+
+#ifdef TRACE_HAVE_ZLIB
+bool TraceDecompressor::inflateGzip() {
+  std::vector<char> chunk(INPUT_CHUNK);
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  // 32 accepts gzip and zlib headers, members of a concatenated file are
+  // decoded one after the other
+  if (inflateInit2(&stream, 15 + 32) != Z_OK) return false;
+  size_t outPos = 0;
+  bool inMember = false, ok = true, outputFull = false;
+  for (;;) {
+    if (stream.avail_in == 0 && !outputFull) {
+      const char *data;
+      size_t n = this->readInput(&data, chunk);
+      if (n == 0) break;
+      stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+      stream.avail_in = uInt(n);
+    }
+    char *out = this->ring[this->head].data.data();
+    stream.next_out = reinterpret_cast<Bytef *>(out + outPos);
+    stream.avail_out = uInt(RING_BUFFER_SIZE - outPos);
+    if (stream.avail_in > 0) inMember = true;
+    int ret = inflate(&stream, Z_NO_FLUSH);
+    outPos = RING_BUFFER_SIZE - stream.avail_out;
+    outputFull = outPos == RING_BUFFER_SIZE;
+    if (ret == Z_STREAM_END) {
+      inflateReset(&stream);
+      inMember = false;
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      ok = false;
+      break;
+    }
+    if (outPos == RING_BUFFER_SIZE) {
+      if (!this->publish(outPos)) break;
+      outPos = 0;
+    }
+  }
+  inflateEnd(&stream);
+  this->publish(outPos);
+  return ok && !inMember;
+}
+#endif
+
+#ifdef TRACE_HAVE_ZSTD
+bool TraceDecompressor::decodeZstd() {
+  std::vector<char> chunk(INPUT_CHUNK);
+  ZSTD_DStream *stream = ZSTD_createDStream();
+  if (stream == nullptr) return false;
+  ZSTD_inBuffer in = {nullptr, 0, 0};
+  size_t outPos = 0;
+  size_t ret = 0;  // 0 once a frame is complete
+  bool ok = true, outputFull = false;
+  for (;;) {
+    if (in.pos == in.size && !outputFull) {
+      const char *data;
+      size_t n = this->readInput(&data, chunk);
+      if (n == 0) break;
+      in = {data, n, 0};
+    }
+    ZSTD_outBuffer out = {this->ring[this->head].data.data(), RING_BUFFER_SIZE,
+                          outPos};
+    size_t inBefore = in.pos;
+    size_t hint = ZSTD_decompressStream(stream, &out, &in);
+    if (ZSTD_isError(hint)) {
+      ok = false;
+      break;
+    }
+    // A call without progress past the end of a frame asks for the next
+    if (in.pos > inBefore || out.pos > outPos) ret = hint;
+    outPos = out.pos;
+    outputFull = outPos == RING_BUFFER_SIZE;
+    if (outPos == RING_BUFFER_SIZE) {
+      if (!this->publish(outPos)) break;
+      outPos = 0;
+    }
+  }
+  ZSTD_freeDStream(stream);
+  this->publish(outPos);
+  return ok && ret == 0;
+}
+#endif
+
+#ifdef TRACE_HAVE_LZMA
+bool TraceDecompressor::decodeXz() {
+  std::vector<char> chunk(INPUT_CHUNK);
+  lzma_stream stream = LZMA_STREAM_INIT;
+  if (lzma_stream_decoder(&stream, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+    return false;
+  lzma_action action = LZMA_RUN;
+  size_t outPos = 0;
+  bool ok = true;
+  for (;;) {
+    if (stream.avail_in == 0 && action == LZMA_RUN) {
+      const char *data = nullptr;
+      size_t n = this->readInput(&data, chunk);
+      if (n == 0) action = LZMA_FINISH;
+      stream.next_in = reinterpret_cast<const uint8_t *>(data);
+      stream.avail_in = n;
+    }
+    char *out = this->ring[this->head].data.data();
+    stream.next_out = reinterpret_cast<uint8_t *>(out + outPos);
+    stream.avail_out = RING_BUFFER_SIZE - outPos;
+    lzma_ret ret = lzma_code(&stream, action);
+    outPos = RING_BUFFER_SIZE - stream.avail_out;
+    if (ret == LZMA_STREAM_END) break;
+    if (ret != LZMA_OK) {
+      ok = false;
+      break;
+    }
+    if (outPos == RING_BUFFER_SIZE) {
+      if (!this->publish(outPos)) break;
+      outPos = 0;
+    }
+  }
+  lzma_end(&stream);
+  this->publish(outPos);
+  return ok;
+}
+#endif
@@ -0,0 +1,369 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "TraceReader.h"
+
+// SSE2 is part of every x86-64 CPU, so no runtime check is needed
+#if defined(__SSE2__) && defined(__GNUC__)
+#define TRACE_PARSE_SSE2
+#include <emmintrin.h>
+#endif
+
+static const char TRACE_MAGIC[4] = {'C', 'T', 'R', 'C'};
+static const size_t READ_AHEAD = 1 << 16;  // bytes
+
+static void putLe(char *p, uint64_t val, uint32_t bytes) {
+  for (uint32_t i = 0; i < bytes; ++i) p[i] = char(val >> (8 * i));
+}
+
+static uint64_t getLe(const char *p, uint32_t bytes) {
+  uint64_t val = 0;
+  for (uint32_t i = 0; i < bytes; ++i) val |= uint64_t(uint8_t(p[i])) << (8 * i);
+  return val;
+}
+
+// Blanks are spaces, tabs and the carriage returns of DOS line ends
+static bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+static const char *skipBlanks(const char *p, const char *end) {
+  while (p < end && isBlank(*p)) ++p;
+  return p;
+}
+
+// Value of every character as a hex digit, 16 for non-digits
+struct HexTable {
+  uint8_t value[256];
+  HexTable() {
+    memset(this->value, 16, sizeof(this->value));
+    for (int i = 0; i < 10; ++i) this->value['0' + i] = i;
+    for (int i = 0; i < 6; ++i) {
+      this->value['a' + i] = 10 + i;
+      this->value['A' + i] = 10 + i;
+    }
+  }
+};
+static const HexTable hexTable;
+
+static uint32_t hexDigit(char c) { return hexTable.value[uint8_t(c)]; }
+
+#ifdef TRACE_PARSE_SSE2
+
+// Classifies and converts 16 characters at once. p must have 16 readable
+// bytes. Returns nullptr when all 16 are digits, longer numbers are left
+// to the scalar loop.
+static const char *parseHexSSE2(const char *p, uint32_t *val) {
+  __m128i text = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  __m128i digit = _mm_sub_epi8(text, _mm_set1_epi8('0'));
+  __m128i isDigit =
+      _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+  __m128i letter = _mm_sub_epi8(_mm_or_si128(text, _mm_set1_epi8(0x20)),
+                                _mm_set1_epi8('a'));
+  __m128i isLetter =
+      _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+  uint32_t other =
+      ~uint32_t(_mm_movemask_epi8(_mm_or_si128(isDigit, isLetter)));
+  uint32_t length = __builtin_ctz(other | 0x10000);
+  if (length == 0) return p;
+  if (length == 16) return nullptr;
+  __m128i nibbles = _mm_or_si128(
+      _mm_and_si128(isDigit, digit),
+      _mm_and_si128(isLetter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+  // Clear what follows the number, then pack two digits per byte, most
+  // significant first
+  __m128i index = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
+                                13, 14, 15);
+  nibbles = _mm_and_si128(
+      nibbles, _mm_cmplt_epi8(index, _mm_set1_epi8(char(length))));
+  __m128i pairs =
+      _mm_or_si128(_mm_slli_epi16(nibbles, 4), _mm_srli_epi16(nibbles, 8));
+  pairs = _mm_packus_epi16(_mm_and_si128(pairs, _mm_set1_epi16(0xFF)),
+                           _mm_setzero_si128());
+  uint64_t packed;
+  _mm_storel_epi64(reinterpret_cast<__m128i *>(&packed), pairs);
+  *val = uint32_t(__builtin_bswap64(packed) >> (64 - 4 * length));
+  return p + length;
+}
+
+#endif
+
+// Hex number with optional 0x prefix at p, before end. Longer numbers
+// keep their low 32 bits like a cast of strtoul. Returns the character
+// after it, p itself when there is none. Bytes up to limit, the end of the
+// loaded trace, may be read ahead: end is a newline or limit itself, so a
+// number never runs past it.
+static const char *parseHex(const char *p, const char *end, const char *limit,
+                            uint32_t *val) {
+  if (end - p > 2 && p[0] == '0' && (p[1] | 0x20) == 'x' &&
+      hexDigit(p[2]) < 16)
+    p += 2;
+#ifdef TRACE_PARSE_SSE2
+  if (limit - p >= 16) {
+    const char *next = parseHexSSE2(p, val);
+    if (next != nullptr) return next;
+  }
+#endif
+  const char *digits = p;
+  uint32_t n = 0;
+  for (uint32_t digit; p < end && (digit = hexDigit(*p)) < 16; ++p)
+    n = n << 4 | digit;
+  if (p != digits) *val = n;
+  return p;
+}
+
+// "<op> <address> [I|D] [<pc>]" with any blanks around the fields, the
+// line starting at its op, limit as for parseHex. False for anything else.
+static bool parseTextLine(const char *p, const char *end, const char *limit,
+                          TraceRecord &record) {
+  char op = *p++;
+  if ((op != 'r' && op != 'w') || p == end || !isBlank(*p)) return false;
+  p = skipBlanks(p, end);
+  const char *next = parseHex(p, end, limit, &record.addr);
+  if (next == p || (next < end && !isBlank(*next))) return false;
+  p = skipBlanks(next, end);
+  // A lone I or D is the type column, anything else the PC
+  record.type = 0;
+  if (p < end && (*p == 'I' || *p == 'D') &&
+      (p + 1 == end || isBlank(p[1]))) {
+    record.type = *p;
+    p = skipBlanks(p + 1, end);
+  }
+  record.pc = 0;
+  p = skipBlanks(parseHex(p, end, limit, &record.pc), end);
+  record.op = op;
+  record.size = 0;
+  return p == end;
+}
+
+bool TraceReader::open(const char *path) {
+  this->close();
+  this->binary = false;
+  this->flags = 0;
+  this->lastAddr = 0;
+  this->lineNumber = 0;
+  this->malformedLines = 0;
+  // stdin is duplicated so that close() can treat it like any file
+  int fd = strcmp(path, "-") == 0 ? dup(STDIN_FILENO)
+                                  : ::open(path, O_RDONLY);
+  if (fd < 0) return false;
+  this->fd = fd;
+  struct stat st;
+  this->stream = fstat(fd, &st) != 0 || !S_ISREG(st.st_mode);
+  if (!this->stream && st.st_size > 0) {
+    void *mapping =
+        mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping != MAP_FAILED) {
+      madvise(mapping, size_t(st.st_size), MADV_SEQUENTIAL);
+      this->mapping = mapping;
+      this->mappingSize = size_t(st.st_size);
+      this->data = static_cast<const char *>(mapping);
+      this->end = this->mappingSize;
+    }
+  }
+  if (this->mapping != nullptr) {
+    ::close(fd);
+    this->fd = -1;
+  } else {
+    this->buffer.resize(READ_AHEAD);
+    this->data = this->buffer.data();
+    this->fill();
+  }
+
+  // Compressed input is decoded on another thread and read from there
+  TraceCompression compression =
+      detectTraceCompression(this->data + this->pos, this->end - this->pos);
+  if (compression != TRACE_PLAIN) {
+    if (!traceCompressionSupported(compression)) {
+      fprintf(stderr, "Built without %s support, unable to read %s\n",
+              traceCompressionName(compression), path);
+      this->close();
+      return false;
+    }
+    // What was read to detect the format goes to the decoder first
+    if (this->mapping == nullptr)
+      this->compressedHead.assign(this->data + this->pos,
+                                  this->data + this->end);
+    const char *input = this->mapping != nullptr
+                            ? this->data + this->pos
+                            : this->compressedHead.data();
+    size_t inputSize = this->mapping != nullptr ? this->end - this->pos
+                                                : this->compressedHead.size();
+    this->decompressor =
+        new TraceDecompressor(compression, input, inputSize, this->fd);
+    this->buffer.resize(READ_AHEAD);
+    this->data = this->buffer.data();
+    this->pos = this->end = 0;
+  }
+
+  if (this->end - this->pos < TRACE_HEADER_SIZE) this->fill();
+  const char *header = this->data + this->pos;
+  if (this->end - this->pos >= TRACE_HEADER_SIZE &&
+      memcmp(header, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0) {
+    uint16_t version = uint16_t(getLe(header + 4, 2));
+    this->flags = uint16_t(getLe(header + 6, 2));
+    this->recordSize = uint32_t(getLe(header + 8, 4));
+    this->recordsLeft = getLe(header + 16, 8);
+    uint32_t minSize = (this->flags & TRACE_HAS_PC) ? 12 : 8;
+    if (version != TRACE_FORMAT_VERSION || this->recordSize < minSize ||
+        this->recordSize > READ_AHEAD) {
+      fprintf(stderr, "Unsupported binary trace version %d\n", version);
+      this->close();
+      return false;
+    }
+    this->binary = true;
+    this->pos += TRACE_HEADER_SIZE;
+  }
+  return true;
+}
+
+bool TraceReader::fill() {
+  if (this->fd < 0 && this->decompressor == nullptr) return false;
+  size_t left = this->end - this->pos;
+  memmove(this->buffer.data(), this->buffer.data() + this->pos, left);
+  // A line longer than the buffer
+  if (left == this->buffer.size()) this->buffer.resize(left * 2);
+  this->data = this->buffer.data();
+  this->pos = 0;
+  this->end = left;
+  // Pipes return what is there, keep reading until the buffer is full
+  while (this->end < this->buffer.size()) {
+    char *dst = this->buffer.data() + this->end;
+    size_t size = this->buffer.size() - this->end;
+    ssize_t n = this->decompressor != nullptr
+                    ? ssize_t(this->decompressor->read(dst, size))
+                    : ::read(this->fd, dst, size);
+    if (n <= 0) break;
+    this->end += size_t(n);
+  }
+  return this->end > left;
+}
+
+bool TraceReader::next(TraceRecord &record) {
+  return this->binary ? this->nextBinary(record) : this->nextText(record);
+}
+
+size_t TraceReader::next(TraceRecord *records, size_t count) {
+  size_t n = 0;
+  if (this->binary) {
+    while (n < count && this->nextBinary(records[n])) ++n;
+  } else {
+    while (n < count && this->nextText(records[n])) ++n;
+  }
+  return n;
+}
+
+bool TraceReader::nextText(TraceRecord &record) {
+  for (;;) {
+    const char *newline = static_cast<const char *>(
+        memchr(this->data + this->pos, '\n', this->end - this->pos));
+    // The last line may lack its newline
+    if (newline == nullptr && this->fill()) continue;
+    // fill() moves what is left to the start of the buffer
+    const char *p = this->data + this->pos;
+    if (p == this->data + this->end) return false;
+    const char *lineEnd = newline ? newline : this->data + this->end;
+    this->pos = lineEnd - this->data + (newline ? 1 : 0);
+
+    this->lineNumber++;
+
+    const char *first = skipBlanks(p, lineEnd);
+    if (first == lineEnd) continue;
+    if (parseTextLine(first, lineEnd, this->data + this->end, record))
+      return true;
+    this->reportMalformed(p, lineEnd);
+  }
+}
+
+void TraceReader::reportMalformed(const char *line, const char *lineEnd) {
+  this->malformedLines++;
+  if (this->quiet) return;
+  if (this->malformedLines <= MAX_REPORTED_LINES) {
+    while (lineEnd > line && isBlank(lineEnd[-1])) --lineEnd;
+    int length = int(lineEnd - line < 80 ? lineEnd - line : 80);
+    fprintf(stderr, "Skipping malformed trace line %lu: %.*s\n",
+            this->lineNumber, length, line);
+  } else if (this->malformedLines == MAX_REPORTED_LINES + 1) {
+    fprintf(stderr, "Further malformed trace lines are skipped silently\n");
+  }
+}
+
+bool TraceReader::nextBinary(TraceRecord &record) {
+  if (this->recordsLeft == 0) return false;
+  if (this->end - this->pos < this->recordSize) this->fill();
+  if (this->end - this->pos < this->recordSize) {
+    fprintf(stderr, "Binary trace truncated, %lu records missing\n",
+            this->recordsLeft);
+    this->recordsLeft = 0;
+    return false;
+  }
+  const char *p = this->data + this->pos;
+  record.op = p[0];
+  record.type = p[1];
+  record.size = uint8_t(p[2]);
+  this->lastAddr += uint32_t(getLe(p + 4, 4));
+  record.addr = this->lastAddr;
+  record.pc = (this->flags & TRACE_HAS_PC) ? uint32_t(getLe(p + 8, 4)) : 0;
+  this->pos += this->recordSize;
+  this->recordsLeft--;
+  return true;
+}
+
+void TraceReader::close() {
+  // The decoder thread reads the mapping and fd, stop it first
+  delete this->decompressor;
+  this->decompressor = nullptr;
+  this->compressedHead.clear();
+  if (this->mapping != nullptr) munmap(this->mapping, this->mappingSize);
+  this->mapping = nullptr;
+  this->mappingSize = 0;
+  if (this->fd >= 0) ::close(this->fd);
+  this->fd = -1;
+  this->data = nullptr;
+  this->pos = this->end = 0;
+}
+
+bool TraceWriter::open(const char *path, bool withPc) {
+  this->file.open(path, std::ios::binary | std::ios::trunc);
+  if (!this->file.is_open()) return false;
+  this->flags = withPc ? TRACE_HAS_PC : 0;
+  this->count = 0;
+  this->lastAddr = 0;
+  // The header is written again with the count once it is known
+  char header[TRACE_HEADER_SIZE] = {0};
+  this->file.write(header, TRACE_HEADER_SIZE);
+  return this->file.good();
+}
+
+void TraceWriter::write(const TraceRecord &record) {
+  char out[12] = {0};
+  out[0] = record.op;
+  out[1] = record.type;
+  out[2] = char(record.size);
+  putLe(out + 4, uint32_t(record.addr - this->lastAddr), 4);
+  this->lastAddr = record.addr;
+  uint32_t size = 8;
+  if (this->flags & TRACE_HAS_PC) {
+    putLe(out + 8, record.pc, 4);
+    size = 12;
+  }
+  this->file.write(out, size);
+  this->count++;
+}
+
+bool TraceWriter::close() {
+  char header[TRACE_HEADER_SIZE] = {0};
+  memcpy(header, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  putLe(header + 4, TRACE_FORMAT_VERSION, 2);
+  putLe(header + 6, this->flags, 2);
+  putLe(header + 8, (this->flags & TRACE_HAS_PC) ? 12 : 8, 4);
+  putLe(header + 16, this->count, 8);
+  this->file.seekp(0);
+  this->file.write(header, TRACE_HEADER_SIZE);
+  bool ok = this->file.good();
+  this->file.close();
+  return ok;
+}
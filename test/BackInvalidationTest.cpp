@@ -0,0 +1,98 @@
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <unordered_map>
+
+#include "Cache.h"
+#include "MemoryManager.h"
+#include "MultiLevelCacheConfig.h"
+
+// Stores and loads random bytes through a three-level hierarchy whose
+// inclusive L3 keeps back-invalidating blocks that L1 has modified while
+// write-through stores to them are still in L2's write buffer. L1's
+// prefetches make L3 evict without L2 fetching, which would drain the
+// buffer first. Every load must return the last value stored, and every
+// block above L3 must be in L3 after each access.
+
+static const uint32_t BASE = 0x10000;
+static const uint32_t REGION = 2048;
+static const uint32_t BLOCK_SIZE = 32;
+
+static Cache::Policy shrink(Cache::Policy policy, uint32_t sets,
+                            uint32_t ways) {
+  policy.blockSize = BLOCK_SIZE;
+  policy.associativity = ways;
+  policy.blockNum = sets * ways;
+  policy.cacheSize = policy.blockNum * policy.blockSize;
+  policy.tagOnly = false;
+  return policy;
+}
+
+static int run(const char *name, Cache::Policy l1policy,
+               Cache::Policy l2policy, Cache::Policy l3policy) {
+  MemoryManager *memory = new MemoryManager();
+  Cache *l3cache = new Cache(memory, l3policy, nullptr, 0);
+  Cache *l2cache = new Cache(memory, l2policy, l3cache, 0);
+  Cache *l1cache = new Cache(memory, l1policy, l2cache, 0);
+  memory->setCache(l1cache);
+
+  std::mt19937 rng(1);
+  std::unordered_map<uint32_t, uint8_t> expected;
+  int failures = 0;
+  for (uint32_t i = 0; i < 200000 && failures < 10; ++i) {
+    uint32_t addr = BASE + rng() % REGION;
+    if (!memory->isPageExist(addr)) memory->addPage(addr);
+    if (rng() % 3 == 0) {
+      uint8_t val = uint8_t(rng());
+      l1cache->setByte(addr, val);
+      expected[addr] = val;
+    } else {
+      uint8_t val = l1cache->getByte(addr);
+      auto it = expected.find(addr);
+      uint8_t want = it == expected.end() ? 0 : it->second;
+      if (val != want) {
+        printf("%s, access %u: load of 0x%x returned %u instead of %u\n",
+               name, i, addr, val, want);
+        failures++;
+      }
+    }
+    for (uint32_t block = BASE; block < BASE + REGION; block += BLOCK_SIZE) {
+      if ((l1cache->inCache(block) || l2cache->inCache(block)) &&
+          !l3cache->inCache(block)) {
+        printf("%s, access %u: block 0x%x is above L3 but not in it\n", name,
+               i, block);
+        failures++;
+      }
+    }
+  }
+  if (l3cache->statistics.numBackInvalidation == 0) {
+    printf("%s: no back-invalidation happened\n", name);
+    failures++;
+  }
+
+  delete l1cache;
+  delete l2cache;
+  delete l3cache;
+  delete memory;
+  return failures;
+}
+
+int main() {
+  Cache::Policy l1policy = shrink(MultiLevelCacheConfig::getL1Policy(), 4, 1);
+  Cache::Policy l2policy = shrink(MultiLevelCacheConfig::getL2Policy(), 8, 2);
+  Cache::Policy l3policy = shrink(MultiLevelCacheConfig::getL3Policy(), 32, 1);
+  l1policy.prefetcher = PREFETCH_BOP;
+  l2policy.writePolicy = WRITE_THROUGH;
+  l2policy.writeBufferEntries = 2;
+  l3policy.writePolicy = WRITE_THROUGH;
+  l3policy.writeBufferEntries = 4;
+  l3policy.inclusion = INCLUSION_INCLUSIVE;
+  int failures = run("Write buffers", l1policy, l2policy, l3policy);
+
+  // Prefetches arriving in L3 while L1 fills a block from it evict blocks
+  // of L3, possibly the one being filled
+  l2policy.prefetcher = PREFETCH_SMS;
+  l3policy.prefetcher = PREFETCH_STRIDE;
+  failures += run("Prefetches below", l1policy, l2policy, l3policy);
+  return failures == 0 ? 0 : 1;
+}